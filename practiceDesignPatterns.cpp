@@ -16,27 +16,77 @@ https://github.com/kamranahmedse/design-patterns-for-humans?tab=readme-ov-file#-
 #include<stack>
 #include<map>
 #include<unordered_map>
+#include<unordered_set>
 #include<set>
+#include<vector>
+#include<memory>
+#include<atomic>
+#include<thread>
+#include<chrono>
+#include<cstdint>
+#include<climits>
+#include<string_view>
+#include<type_traits>
+#include<fstream>
+#include<iomanip>
+#include<array>
+#include<bitset>
+#include<deque>
+#include<functional>
+#include<regex>
+#include<condition_variable>
+#include<mutex>
+#include<cerrno>
+#include<cstdio>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/uio.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/syscall.h>
+#include<sys/inotify.h>
+#include<dirent.h>
+#include<fnmatch.h>
+#include<poll.h>
+#ifdef __AVX2__
+#include<immintrin.h>
+#endif
 
 class Logger {
     protected:
         Logger* nextLogger;
     public:
         Logger(): nextLogger(nullptr){}
+        virtual ~Logger() {}
         void setNextLogger(Logger* next) {
             nextLogger = next;
         }
-        void logMessage(int level, std::string msg) {
+        Logger* getNextLogger() const {
+            return nextLogger;
+        }
+        void logMessage(int level, const std::string& msg) {
             if(canHandle(level)) {
-                write(msg);
+                writeAt(level, msg);
             }
             if(nextLogger!=nullptr) {
                 nextLogger->logMessage(level,msg);
             }
         }
 
+        void flushAll() {
+            flush();
+            if(nextLogger!=nullptr) {
+                nextLogger->flushAll();
+            }
+        }
+
         virtual bool canHandle(int level) = 0;
-        virtual void write(std::string msg) = 0;
+        virtual void write(const std::string& msg) = 0;
+        // sinks that keep the level of each message override this one
+        virtual void writeAt(int, const std::string& msg) {
+            write(msg);
+        }
+        virtual void flush() {}
 };
 
 class ConsoleLogger: public Logger {
@@ -47,24 +97,242 @@ class ConsoleLogger: public Logger {
         bool canHandle(int level) override {
             return level >= logLevel;
         }
-        void write(std::string msg) override {
-            std::cout<<"msg"<<std::endl;
+        void write(const std::string& msg) override {
+            std::cout<<msg<<'\n';
         }
+        void flush() override {
+            std::cout.flush();
+        }
+
+};
+
+enum class FsyncPolicy { Never, OnFlush, EveryWrite };
 
+struct FileSinkOptions {
+    size_t bufferSize = 1 << 16;             // per writer thread
+    size_t maxFileSize = 0;                  // rotate after this many bytes, 0 = never
+    std::chrono::seconds rotateInterval{0};  // rotate after this long, 0 = never
+    FsyncPolicy fsync = FsyncPolicy::Never;
 };
 
+// Every writer thread appends into its own buffer, so a message costs a
+// memcpy; the file only sees a writev when a buffer fills up or on flush().
+// Rotation happens on that write path, writers filling buffers never wait on it.
+// That includes rotateInterval: an idle sink keeps its file open past the
+// interval and rotates on the next writev or flush().
 class FileLogger: public Logger {
     private:
+        struct ThreadBuffer {
+            std::thread::id owner;
+            std::mutex lock;
+            std::string data;
+        };
+        static constexpr int maxIov = 1024;
+
         int logLevel;
+        std::string path;
+        FileSinkOptions options;
+        uint64_t id;
+        std::mutex registryLock;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+        std::mutex fileLock;
+        int fd;
+        size_t fileBytes;
+        std::chrono::steady_clock::time_point openedAt;
+        int rotation;
+
+        static uint64_t nextId() {
+            static std::atomic<uint64_t> counter(0);
+            return ++counter;
+        }
+
+        // Each thread caches its buffers in a small table indexed by sink id,
+        // so a thread writing through a chain of file sinks finds every one
+        // of them without the registry; ids are handed out in order, so up
+        // to cacheSlots sinks created together never evict each other.
+        static constexpr size_t cacheSlots = 16;
+
+        ThreadBuffer* localBuffer() {
+            // ids instead of addresses, a new sink may reuse a dead one's address
+            struct CacheEntry {
+                uint64_t owner;
+                ThreadBuffer* buffer;
+            };
+            thread_local CacheEntry cache[cacheSlots] = {};
+            CacheEntry& cached = cache[id % cacheSlots];
+            if(cached.owner == id) {
+                return cached.buffer;
+            }
+            std::lock_guard<std::mutex> guard(registryLock);
+            ThreadBuffer* found = nullptr;
+            for(auto& b : buffers) {
+                if(b->owner == std::this_thread::get_id()) {
+                    found = b.get();
+                }
+            }
+            if(found == nullptr) {
+                buffers.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer()));
+                found = buffers.back().get();
+                found->owner = std::this_thread::get_id();
+                found->data.reserve(options.bufferSize);
+            }
+            cached = CacheEntry{id, found};
+            return found;
+        }
+
+        void openFile() {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if(fd < 0) {
+                std::perror(path.c_str());
+            }
+            fileBytes = fd < 0 ? 0 : (size_t)::lseek(fd, 0, SEEK_END);
+            openedAt = std::chrono::steady_clock::now();
+        }
+
+        // the highest N of an existing path.N, so a restarted process keeps
+        // numbering after the previous run instead of overwriting its files
+        static int lastRotation(const std::string& path) {
+            size_t slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+            std::string prefix = (slash == std::string::npos ? path : path.substr(slash + 1)) + ".";
+            DIR* d = ::opendir(dir.c_str());
+            if(d == nullptr) {
+                return 0;
+            }
+            int highest = 0;
+            while(struct dirent* entry = ::readdir(d)) {
+                const char* name = entry->d_name;
+                if(std::strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+                    continue;
+                }
+                const char* digits = name + prefix.size();
+                long n = 0;
+                const char* c = digits;
+                for(; *c >= '0' && *c <= '9' && n <= INT_MAX / 10; ++c) {
+                    n = n * 10 + (*c - '0');
+                }
+                if(c != digits && *c == '\0' && n <= INT_MAX) {
+                    highest = std::max(highest, (int)n);
+                }
+            }
+            ::closedir(d);
+            return highest;
+        }
+
+        // caller holds fileLock
+        void rotateIfNeeded() {
+            bool bySize = options.maxFileSize > 0 && fileBytes >= options.maxFileSize;
+            bool byTime = options.rotateInterval.count() > 0 &&
+                          std::chrono::steady_clock::now() - openedAt >= options.rotateInterval;
+            if(!bySize && !byTime) {
+                return;
+            }
+            if(fd >= 0) {
+                if(options.fsync != FsyncPolicy::Never) {
+                    ::fsync(fd);
+                }
+                ::close(fd);
+            }
+            std::string rotated = path + "." + std::to_string(++rotation);
+            std::rename(path.c_str(), rotated.c_str());
+            openFile();
+        }
+
+        // caller holds fileLock
+        void writeAll(struct iovec* iov, int count) {
+            while(count > 0 && fd >= 0) {
+                ssize_t n = ::writev(fd, iov, count);
+                if(n < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    std::perror(path.c_str());
+                    return;
+                }
+                fileBytes += n;
+                while(count > 0 && (size_t)n >= iov->iov_len) {
+                    n -= iov->iov_len;
+                    ++iov;
+                    --count;
+                }
+                if(count > 0) {
+                    iov->iov_base = (char*)iov->iov_base + n;
+                    iov->iov_len -= n;
+                }
+            }
+        }
+
+        void writeVectored(struct iovec* iov, int count) {
+            std::lock_guard<std::mutex> guard(fileLock);
+            rotateIfNeeded();
+            writeAll(iov, count);
+            if(options.fsync == FsyncPolicy::EveryWrite && fd >= 0) {
+                ::fsync(fd);
+            }
+        }
+
     public:
-        FileLogger(int level): logLevel(level){}
+        FileLogger(int level, const std::string& path = "app.log", FileSinkOptions options = FileSinkOptions())
+            : logLevel(level), path(path), options(options), id(nextId()), fd(-1), fileBytes(0), rotation(lastRotation(path)) {
+            openFile();
+        }
+
+        ~FileLogger() {
+            flush();
+            if(fd >= 0) {
+                ::close(fd);
+            }
+        }
+
         bool canHandle(int level) override {
             return level >= logLevel;
         }
-        void write(std::string msg) override {
-            std::cout<<"msg"<<std::endl;
+
+        void write(const std::string& msg) override {
+            ThreadBuffer* buffer = localBuffer();
+            std::lock_guard<std::mutex> guard(buffer->lock);
+            if(buffer->data.size() + msg.size() + 1 > options.bufferSize) {
+                // hand the pending bytes and this line to the kernel in one call
+                struct iovec iov[3] = {
+                    {(void*)buffer->data.data(), buffer->data.size()},
+                    {(void*)msg.data(), msg.size()},
+                    {(void*)"\n", 1}
+                };
+                writeVectored(iov, 3);
+                buffer->data.clear();
+                return;
+            }
+            buffer->data += msg;
+            buffer->data += '\n';
+        }
+
+        // gathers every thread's buffer into as few writev calls as possible
+        void flush() override {
+            std::lock_guard<std::mutex> registryGuard(registryLock);
+            std::vector<std::unique_lock<std::mutex>> held;
+            std::vector<struct iovec> iov;
+            held.reserve(buffers.size());
+            iov.reserve(buffers.size());
+            for(auto& b : buffers) {
+                held.emplace_back(b->lock);
+                if(!b->data.empty()) {
+                    iov.push_back({(void*)b->data.data(), b->data.size()});
+                }
+            }
+            {
+                std::lock_guard<std::mutex> guard(fileLock);
+                rotateIfNeeded();
+                for(size_t i = 0; i < iov.size(); i += maxIov) {
+                    writeAll(&iov[i], (int)std::min(iov.size() - i, (size_t)maxIov));
+                }
+                if(options.fsync != FsyncPolicy::Never && fd >= 0) {
+                    ::fsync(fd);
+                }
+            }
+            for(auto& b : buffers) {
+                b->data.clear();
+            }
         }
-        
 };
 
 class ErrorLogger: public Logger {
@@ -75,430 +343,6517 @@ class ErrorLogger: public Logger {
         bool canHandle(int level) override {
             return level >= logLevel;
         }
-        void write(std::string msg) override {
-            std::cout<<"msg"<<std::endl;
+        void write(const std::string& msg) override {
+            std::cout<<msg<<'\n';
+        }
+        void flush() override {
+            std::cout.flush();
         }
-        
-};
-
-int main() {
-    Logger* conSoleLogger = new ConsoleLogger(1);
-    Logger* fileLogger = new FileLogger(2);
-    Logger* errorLogger = new ErrorLogger(3);
-
-    errorLogger->setNextLogger(fileLogger);
-    fileLogger->setNextLogger(conSoleLogger);
-
-    errorLogger->logMessage(3,"this is a hotel level message");
-}
-
-
-
-// Imagine we are building a simple text editor that can execute commands like
-// "write text," "undo the last command," and "redo a command."
-// The Command pattern can encapsulate these actions as objects.
 
-///////////////////////////////
-// Command ////////////////////
-///////////////////////////////
+};
 
+// Async mode: producers push records into a bounded ring and a single
+// background thread drains it into the chain in batches, so request
+// threads never wait on the sinks' I/O.
 
-class Command {
+// Bounded multi-producer/multi-consumer ring (Vyukov). Every cell carries a
+// sequence number, so a producer claims a slot with one CAS and never locks.
+template<typename T>
+class BoundedQueue {
+    private:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            T data;
+        };
+        std::unique_ptr<Cell[]> cells;
+        size_t mask;
+        alignas(64) std::atomic<size_t> enqueuePos;
+        alignas(64) std::atomic<size_t> dequeuePos;
     public:
-        virtual void execute() = 0;
-        virtual void undo() = 0;
-};
+        explicit BoundedQueue(size_t capacity): mask(0), enqueuePos(0), dequeuePos(0) {
+            size_t size = 2;
+            while(size < capacity) {
+                size <<= 1;
+            }
+            cells.reset(new Cell[size]);
+            mask = size - 1;
+            for(size_t i = 0; i < size; ++i) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
 
-class TextEditor {
-    private: 
-        std::string text;
-    public:
-        void writeText(std::string newText) {
-            text+=newText;
+        // value is only moved from when the push succeeds
+        bool tryPush(T&& value) {
+            Cell* cell;
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            for(;;) {
+                cell = &cells[pos & mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+                if(diff == 0) {
+                    if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if(diff < 0) {
+                    return false;
+                } else {
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->data = std::move(value);
+            cell->sequence.store(pos + 1, std::memory_order_release);
+            return true;
         }
-        void removeText(int length) {
-            text.erase(text.length()-length, length);
+
+        bool tryPop(T& out) {
+            Cell* cell;
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            for(;;) {
+                cell = &cells[pos & mask];
+                size_t seq = cell->sequence.load(std::memory_order_acquire);
+                std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+                if(diff == 0) {
+                    if(dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if(diff < 0) {
+                    return false;
+                } else {
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            out = std::move(cell->data);
+            cell->sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
         }
 
-        void showText() {
-            std::cout<<text<<std::endl;
+        size_t capacity() const {
+            return mask + 1;
         }
 };
 
-class WriteCommand: public Command {
-    private:
-        TextEditor* textEditor;
-        std::string text;
-    public:
-        WriteCommand(TextEditor *TextEditor, std::string Text): textEditor(TextEditor), text(Text) {}
-
-    void execute() override {
-        textEditor->writeText(text);
-    }
+enum class OverflowPolicy { Block, Drop, DropOldest };
 
-    void undo() override {
-        textEditor->removeText(text.length());
-    }
+struct LogRecord {
+    int level;
+    std::string msg;
 };
 
-class CommandManagaer {
+class AsyncLogger {
     private:
-        std::stack<Command*>commandHistory;
-        std::stack<Command*>redo;
-    public:
-        void executeCommand(Command* command) {
-            command->execute();
-            commandHistory.push(command);
-
+        Logger* chain;
+        OverflowPolicy policy;
+        size_t batchSize;
+        BoundedQueue<LogRecord> queue;
+        std::atomic<bool> running;
+        std::atomic<int> activeProducers;
+        std::atomic<size_t> pushed;
+        std::atomic<size_t> completed;
+        std::atomic<size_t> dropped;
+        std::atomic<bool> parked;
+        std::atomic<int> flushWaiters;
+        std::mutex parkLock;
+        std::condition_variable wakeWorker;
+        std::condition_variable wakeFlushers;
+        std::thread worker;
+
+        // nothing is pending once every accepted record has been completed
+        bool pending() const {
+            return completed.load() != pushed.load();
         }
 
-        void undo() {
-            Command* lastCommand = commandHistory.top();
-            lastCommand->undo();
-            commandHistory.pop();
-            redo.push(lastCommand);
+        void notifyWorker() {
+            if(parked.load()) {
+                std::lock_guard<std::mutex> guard(parkLock);
+                wakeWorker.notify_one();
+            }
         }
 
-        void redoCommand() {
-            Command* redoCommand = redo.top();
-            redoCommand->execute();
-            commandHistory.push(redoCommand);
-            redo.pop();
+        void notifyFlushers() {
+            if(flushWaiters.load() > 0) {
+                std::lock_guard<std::mutex> guard(parkLock);
+                wakeFlushers.notify_all();
+            }
         }
-};
 
-int main() {
-    TextEditor* textEditor;
-    CommandManagaer* commandManager;
-    Command* command1 = new WriteCommand(textEditor, "hello");
-    Command* command2 = new WriteCommand(textEditor, "world");
-
-    commandManager->executeCommand(command1);
-    textEditor->showText();
-    commandManager->executeCommand(command2);
-    textEditor->showText();
-    commandManager->undo();
-    commandManager->undo();
-    commandManager->redoCommand();
-}
+        void drainLoop() {
+            std::vector<LogRecord> batch;
+            batch.reserve(batchSize);
+            for(;;) {
+                LogRecord record;
+                while(batch.size() < batchSize && queue.tryPop(record)) {
+                    batch.push_back(std::move(record));
+                }
+                if(!batch.empty()) {
+                    for(auto& r : batch) {
+                        chain->logMessage(r.level, r.msg);
+                    }
+                    chain->flushAll();
+                    completed.fetch_add(batch.size());
+                    batch.clear();
+                    notifyFlushers();
+                    continue;
+                }
+                // only exit once no producer can still be mid-push
+                if(!running.load()) {
+                    if(activeProducers.load() == 0 && !pending()) {
+                        return;
+                    }
+                    std::this_thread::yield();
+                    continue;
+                }
+                // Park until a producer publishes a record. pushed is bumped
+                // before the record lands, so a producer either is seen by
+                // pending() here or sees parked and takes the lock to notify.
+                std::unique_lock<std::mutex> guard(parkLock);
+                parked.store(true);
+                wakeWorker.wait(guard, [this]() { return pending() || !running.load(); });
+                parked.store(false);
+            }
+        }
 
+    public:
+        AsyncLogger(Logger* chain, size_t capacity = 8192, OverflowPolicy policy = OverflowPolicy::Block, size_t batchSize = 256)
+            : chain(chain), policy(policy), batchSize(batchSize), queue(capacity),
+              running(true), activeProducers(0), pushed(0), completed(0), dropped(0),
+              parked(false), flushWaiters(0) {
+            worker = std::thread(&AsyncLogger::drainLoop, this);
+        }
 
-// Design a vending machine
-// Vending Machine must keep track of the inventory
-// A person should be able to insert cash into the machine & choose an item
-// The Machine should confirm the inserted cash with the price of the selected item
-// The machine must display an error in case of insufficient cash or unavailable item
-// Finally, if all the above steps succeed then the user gets the selected item
+        ~AsyncLogger() {
+            shutdown();
+        }
 
-////////////////////////////////
-// state  /////////////////////
-///////////////////////////////
+        // returns false if the record was dropped or the logger is shut down
+        bool logMessage(int level, std::string msg) {
+            activeProducers.fetch_add(1);
+            if(!running.load()) {
+                activeProducers.fetch_sub(1);
+                return false;
+            }
+            pushed.fetch_add(1);
+            LogRecord record{level, std::move(msg)};
+            bool accepted = true;
+            while(!queue.tryPush(std::move(record))) {
+                if(policy == OverflowPolicy::Drop) {
+                    pushed.fetch_sub(1);
+                    dropped.fetch_add(1);
+                    notifyFlushers();
+                    accepted = false;
+                    break;
+                }
+                if(policy == OverflowPolicy::DropOldest) {
+                    LogRecord oldest;
+                    if(queue.tryPop(oldest)) {
+                        completed.fetch_add(1);
+                        dropped.fetch_add(1);
+                    }
+                } else {
+                    // the ring is full, so the worker is already awake draining it
+                    std::this_thread::yield();
+                }
+            }
+            if(accepted) {
+                notifyWorker();
+            }
+            activeProducers.fetch_sub(1);
+            return accepted;
+        }
 
+        // blocks until everything logged so far has reached the sinks
+        void flush() {
+            flushWaiters.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> guard(parkLock);
+                wakeFlushers.wait(guard, [this]() { return completed.load() >= pushed.load(); });
+            }
+            flushWaiters.fetch_sub(1);
+        }
 
-class VendingMachine;
+        // stops accepting records, drains what is queued and joins the worker
+        void shutdown() {
+            if(!running.exchange(false)) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> guard(parkLock);
+                wakeWorker.notify_one();
+            }
+            worker.join();
+        }
 
-class State {
-    virtual void insertCash(int cash, VendingMachine* machine) = 0;
-    virtual void chooseItem(std::string item, VendingMachine* machine) = 0;
-    virtual void dispenseItem(VendingMachine* machine) = 0;
+        size_t droppedCount() const {
+            return dropped.load();
+        }
 };
 
-class NoCashState: public State {
-    public:
-        void insertCash(int cash, VendingMachine* macine) override;
-        void chooseItem(std::string item, VendingMachine* machine) override {
-            std::cout<<"please insert cash first";
-        }
-        void dispenseItem(VendingMachine* machine) override {
-            std::cout<<"no cash inserted, cannot dispesne item";
-        }
+// Frozen dispatch: the configured chain is walked once per level up front,
+// so a message only touches the sinks that accept it instead of paying one
+// virtual canHandle per node. Re-freeze after changing the chain.
 
-};
+// Levels below LOG_MIN_LEVEL compile away entirely when logged via LOG_AT.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
 
-class HasCashState: public State {
+class LoggerDispatchTable {
+    private:
+        static constexpr int maxLevel = 16;
+        Logger* head;
+        std::vector<Logger*> sinks;
+        size_t offsets[maxLevel + 1];
     public:
-        void insertCash(int cash, VendingMachine* macine) override {
-            std::cout<<"Cash already inserted, select an item";
+        explicit LoggerDispatchTable(Logger* chain): head(nullptr) {
+            freeze(chain);
         }
-        void chooseItem(std::string item, VendingMachine* machine) override;
-        void dispenseItem(VendingMachine* machine) override {
-            std::cout<<"No item chosen, choose an item";
+
+        void freeze(Logger* chain) {
+            head = chain;
+            sinks.clear();
+            for(int level = 0; level < maxLevel; ++level) {
+                offsets[level] = sinks.size();
+                for(Logger* node = chain; node != nullptr; node = node->getNextLogger()) {
+                    if(node->canHandle(level)) {
+                        sinks.push_back(node);
+                    }
+                }
+            }
+            offsets[maxLevel] = sinks.size();
         }
-};
 
-class ItemSelectedState: public State {
-     public:
-        void insertCash(int cash, VendingMachine* macine) override {
-            std::cout<<"Cash already inserted, select an item";
+        void logMessage(int level, const std::string& msg) const {
+            if(level < 0 || level >= maxLevel) {
+                // outside the table, fall back to walking the chain
+                if(head != nullptr) {
+                    head->logMessage(level, msg);
+                }
+                return;
+            }
+            for(size_t i = offsets[level]; i < offsets[level + 1]; ++i) {
+                sinks[i]->writeAt(level, msg);
+            }
         }
-        void chooseItem(std::string item, VendingMachine* machine) override {
-            std::cout<<"Item already selected";
+
+        template<int Level>
+        void logAt(const std::string& msg) const {
+            if constexpr (Level >= LOG_MIN_LEVEL) {
+                logMessage(Level, msg);
+            }
         }
-        void dispenseItem(VendingMachine* machine) override;
-};
 
-class SoldState : public State {
-public:
-    void insertCash(VendingMachine* machine, int amount) override {
-        std::cout << "Please wait, dispensing your item.\n";
-    }
-    void chooseItem(VendingMachine* machine, const std::string& item) override {
-        std::cout << "Please wait, dispensing your item.\n";
-    }
-    void dispenseItem(VendingMachine* machine) override {
-        std::cout << "Dispensing your item...\n";
-        // Transition to NoCashState after dispensing
-    }
+        size_t sinkCount(int level) const {
+            if(level < 0 || level >= maxLevel) {
+                return 0;
+            }
+            return offsets[level + 1] - offsets[level];
+        }
 };
 
-void NoCashState::insertCash(int cash, VendingMachine* machine) {
-    std::cout<<"Inserted amount: "<<cash;
-    machine->setState(machine->getHasCashState());
-}
+// Unlike logAt, the message expression is not even evaluated below the threshold.
+#define LOG_AT(table, level, msg) \
+    do { \
+        if constexpr ((level) >= LOG_MIN_LEVEL) { \
+            (table).logMessage((level), (msg)); \
+        } \
+    } while(0)
+
+// Deferred formatting: the hot path only stores a static format-string id
+// and the raw argument bytes. BinaryLogDecoder renders the text later, so
+// the process never builds a std::string per call.
 
-void HasCashState:: chooseItem(std::string item, VendingMachine* machine) {
-    if(machine->hasItem(item)) {
-        if(machine->getItemPrice(item) <= machine->getCurrentCash()) {
-            // reduce item
-            // update cash
-            machine->setState(machine->getItemSelectedState());
-            machine->dispenseItem();
+class LogFormatRegistry {
+    private:
+        std::mutex lock;
+        std::vector<const char*> formats;
+    public:
+        static LogFormatRegistry& instance() {
+            static LogFormatRegistry registry;
+            return registry;
         }
-    } else {
-        std::cout<<"Item not available";
-    }
-}
 
-void ItemSelectedState:: dispenseItem(VendingMachine* machine) {
-    machine->setState(machine->getNoCashState());
-}
+        // format must be a string literal, it is kept by pointer
+        uint32_t add(const char* format) {
+            std::lock_guard<std::mutex> guard(lock);
+            formats.push_back(format);
+            return (uint32_t)(formats.size() - 1);
+        }
 
-void SoldState::dispenseItem(VendingMachine* machine) {
-    std::cout << "Dispensing item...\n";
-    machine->setState(machine->getNoCashState());
-}
+        const char* get(uint32_t id) {
+            std::lock_guard<std::mutex> guard(lock);
+            return id < formats.size() ? formats[id] : nullptr;
+        }
+};
 
-class VendingMachine {
+// Stream layout, little endian:
+//   header  "BLOG" u32 version
+//   'F' u32 id u32 length bytes            format definition, once per id
+//   'M' i32 level u32 id u32 length args   message
+// and every arg is 'I' i64 | 'U' u64 | 'D' f64 | 'S' u32 length bytes.
+class BinaryLogger: public Logger {
     private:
-        State* noCashState;
-        State* hashCashState;
-        State* itemSelectedstate;
-        State* soldState;
-        State* currentState;
-        int currentCash;
-        std::unordered_map<std::string,int>itemList;
-    public:
-        VendingMachine():noCashState(new NoCashState()), hashCashState(new HasCashState()), itemSelectedstate(new ItemSelectedState()), currentState(noCashState), currentCash(0)
-        {
-            itemList["Soda"] = 20;
-            itemList["Coke"] = 5;
-        } 
+        static constexpr uint32_t version = 1;
+        int logLevel;
+        int fd;
+        std::mutex lock;
+        std::vector<char> buffer;
+        size_t used;
+        std::vector<bool> emitted;
+
+        template<typename T>
+        static size_t encodedSize(const T& value) {
+            if constexpr (std::is_arithmetic<T>::value) {
+                return 1 + 8;
+            } else {
+                return 1 + 4 + std::string_view(value).size();
+            }
+        }
 
-        void setState(State* newState) {
-            currentState = newState;
+        template<typename T>
+        static char* encode(char* out, const T& value) {
+            if constexpr (std::is_floating_point<T>::value) {
+                double v = value;
+                *out++ = 'D';
+                std::memcpy(out, &v, 8);
+                return out + 8;
+            } else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+                int64_t v = value;
+                *out++ = 'I';
+                std::memcpy(out, &v, 8);
+                return out + 8;
+            } else if constexpr (std::is_integral<T>::value) {
+                uint64_t v = value;
+                *out++ = 'U';
+                std::memcpy(out, &v, 8);
+                return out + 8;
+            } else {
+                std::string_view v(value);
+                uint32_t length = (uint32_t)v.size();
+                *out++ = 'S';
+                std::memcpy(out, &length, 4);
+                std::memcpy(out + 4, v.data(), length);
+                return out + 4 + length;
+            }
         }
 
-        void insertCash(int cash) {
-            currentCash+=cash;
-            currentState->insertCash(cash, this);
+        static char* put32(char* out, uint32_t value) {
+            std::memcpy(out, &value, 4);
+            return out + 4;
         }
 
-        void chooseItem(std::string item) {
-            currentState->chooseItem(item, this);
+        // caller holds lock
+        void flushBuffer() {
+            size_t done = 0;
+            while(done < used && fd >= 0) {
+                ssize_t n = ::write(fd, buffer.data() + done, used - done);
+                if(n < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    std::perror("binary log");
+                    break;
+                }
+                done += n;
+            }
+            used = 0;
         }
 
-        void dispenseItem() {
-            currentState->dispenseItem(this);
+        // caller holds lock
+        char* reserve(size_t bytes) {
+            if(used + bytes > buffer.size()) {
+                flushBuffer();
+                if(bytes > buffer.size()) {
+                    buffer.resize(bytes);
+                }
+            }
+            char* out = buffer.data() + used;
+            used += bytes;
+            return out;
         }
 
-        bool hasItem(std::string item) {
-            return itemList[item] > 0;
+        // caller holds lock; emits the definition the first time an id is
+        // used, false for an id the registry never handed out
+        bool knownFormat(uint32_t id) {
+            if(id < emitted.size() && emitted[id]) {
+                return true;
+            }
+            const char* format = LogFormatRegistry::instance().get(id);
+            if(format == nullptr) {
+                return false;
+            }
+            if(id >= emitted.size()) {
+                emitted.resize(id + 1, false);
+            }
+            uint32_t length = (uint32_t)std::strlen(format);
+            char* out = reserve(1 + 4 + 4 + length);
+            *out++ = 'F';
+            out = put32(out, id);
+            out = put32(out, length);
+            std::memcpy(out, format, length);
+            emitted[id] = true;
+            return true;
         }
 
-        bool getItemPrice(std::string item) {
-            return 25;
+        // caller holds lock
+        template<typename... Args>
+        void append(int level, uint32_t formatId, const Args&... args) {
+            size_t payload = (size_t(0) + ... + encodedSize(args));
+            char* out = reserve(1 + 4 + 4 + 4 + payload);
+            *out++ = 'M';
+            out = put32(out, (uint32_t)level);
+            out = put32(out, formatId);
+            out = put32(out, (uint32_t)payload);
+            ((out = encode(out, args)), ...);
         }
 
-        int getCurrentCash() {
-            return currentCash;
+    public:
+        BinaryLogger(int level, const std::string& path, size_t bufferSize = 1 << 16)
+            : logLevel(level), buffer(bufferSize), used(0) {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(fd < 0) {
+                std::perror(path.c_str());
+            }
+            char* out = reserve(8);
+            std::memcpy(out, "BLOG", 4);
+            put32(out + 4, version);
+        }
+
+        ~BinaryLogger() {
+            flush();
+            if(fd >= 0) {
+                ::close(fd);
+            }
         }
 
-        State* getHasCashState() {
-            return hashCashState;
+        template<typename... Args>
+        void record(int level, uint32_t formatId, const Args&... args) {
+            if(level < logLevel) {
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if(!knownFormat(formatId)) {
+                // a stale or made-up id is logged as such, without its arguments
+                static const uint32_t unknown = LogFormatRegistry::instance().add("unknown format id {}");
+                knownFormat(unknown);
+                append(level, unknown, formatId);
+                return;
+            }
+            append(level, formatId, args...);
         }
 
-        State* getNoCashState() {
-            return noCashState;
+        bool canHandle(int level) override {
+            return level >= logLevel;
         }
-        
-        State* getSoldState() {
-            return soldState;
+
+        // messages arriving through the chain are already text, they are
+        // stored verbatim under the level they were logged at
+        void writeAt(int level, const std::string& msg) override {
+            static const uint32_t verbatim = LogFormatRegistry::instance().add("{}");
+            record(level, verbatim, msg);
         }
 
-        State* getItemSelectedState() {
-            return itemSelectedstate;
+        // no level given, file it under this sink's own
+        void write(const std::string& msg) override {
+            writeAt(logLevel, msg);
         }
 
+        void flush() override {
+            std::lock_guard<std::mutex> guard(lock);
+            flushBuffer();
+        }
 };
 
+// One registration per call site, the id is a function-local static.
+#define BINARY_LOG(logger, level, format, ...) \
+    do { \
+        static const uint32_t binaryLogFormatId = LogFormatRegistry::instance().add(format); \
+        (logger).record((level), binaryLogFormatId, ##__VA_ARGS__); \
+    } while(0)
 
-int main() {
-    VendingMachine* machine = new VendingMachine();
-    machine->insertCash(50);
-    machine->chooseItem("Soda");
-    machine->insertCash(20);
-}
+// Offline side: renders a binary log as "[level] text" lines, substituting
+// the arguments for the {} placeholders in order.
+class BinaryLogDecoder {
+    private:
+        static bool read(std::istream& in, void* out, size_t bytes) {
+            return (bool)in.read((char*)out, bytes);
+        }
 
-// Design Unix File Search API to search file with different 
-// arguments as "extension", "name", "size" ... using filter design pattern 
+        // The length comes from the stream, so the buffer only grows as the
+        // bytes actually arrive: a corrupt length ends in a short read, not
+        // in a multi-gigabyte allocation.
+        static bool readBlock(std::istream& in, std::string& out, uint32_t length) {
+            static constexpr size_t chunk = 1 << 16;
+            out.clear();
+            while(out.size() < length) {
+                size_t n = std::min(chunk, length - out.size());
+                size_t at = out.size();
+                out.resize(at + n);
+                if(!read(in, &out[at], n)) {
+                    return false;
+                }
+            }
+            return true;
+        }
 
-////////////////////////////////
-// Criteria   /////////////////
-///////////////////////////////
+        static bool renderArg(const char*& p, const char* end, std::ostream& out) {
+            if(p >= end) {
+                return false;
+            }
+            char tag = *p++;
+            if(tag == 'S') {
+                uint32_t length;
+                if(end - p < 4) {
+                    return false;
+                }
+                std::memcpy(&length, p, 4);
+                p += 4;
+                if((size_t)(end - p) < length) {
+                    return false;
+                }
+                out.write(p, length);
+                p += length;
+                return true;
+            }
+            if(end - p < 8) {
+                return false;
+            }
+            if(tag == 'I') {
+                int64_t v;
+                std::memcpy(&v, p, 8);
+                out << v;
+            } else if(tag == 'U') {
+                uint64_t v;
+                std::memcpy(&v, p, 8);
+                out << v;
+            } else if(tag == 'D') {
+                double v;
+                std::memcpy(&v, p, 8);
+                out << v;
+            } else {
+                return false;
+            }
+            p += 8;
+            return true;
+        }
 
-class File {
-private:
-    std::string name;
-    std::string extension;
-    int size; // Size in KB
+    public:
+        // returns false on a foreign or corrupt stream; a torn last record is ignored
+        static bool decode(std::istream& in, std::ostream& out) {
+            char magic[4];
+            uint32_t version;
+            if(!read(in, magic, 4) || std::memcmp(magic, "BLOG", 4) != 0 || !read(in, &version, 4) || version != 1) {
+                return false;
+            }
+            std::unordered_map<uint32_t, std::string> formats;
+            std::string payload;
+            char kind;
+            while(read(in, &kind, 1)) {
+                if(kind == 'F') {
+                    uint32_t id, length;
+                    if(!read(in, &id, 4) || !read(in, &length, 4)) {
+                        return true;
+                    }
+                    std::string format;
+                    if(!readBlock(in, format, length)) {
+                        return true;
+                    }
+                    formats[id] = std::move(format);
+                } else if(kind == 'M') {
+                    int32_t level;
+                    uint32_t id, length;
+                    if(!read(in, &level, 4) || !read(in, &id, 4) || !read(in, &length, 4)) {
+                        return true;
+                    }
+                    if(!readBlock(in, payload, length)) {
+                        return true;
+                    }
+                    auto format = formats.find(id);
+                    if(format == formats.end()) {
+                        return false;
+                    }
+                    const char* p = payload.data();
+                    const char* end = p + payload.size();
+                    const std::string& f = format->second;
+                    out << "[" << level << "] ";
+                    for(size_t i = 0; i < f.size(); ++i) {
+                        if(f[i] == '{' && i + 1 < f.size() && f[i + 1] == '}') {
+                            if(!renderArg(p, end, out)) {
+                                return false;
+                            }
+                            ++i;
+                        } else {
+                            out << f[i];
+                        }
+                    }
+                    out << '\n';
+                } else {
+                    return false;
+                }
+            }
+            return true;
+        }
+};
 
-public:
-    File(const std::string& name, const std::string& extension, int size)
-        : name(name), extension(extension), size(size) {}
+// Logger benchmark: messages/sec and p50/p99/p999 call latency of
+// logMessage, varying chain length, level distribution, producer threads,
+// sink type and whether the chain is frozen into a LoggerDispatchTable.
 
-    std::string getName() const { return name; }
-    std::string getExtension() const { return extension; }
-    int getSize() const { return size; }
+class NullLogger: public Logger {
+    private:
+        int logLevel;
+    public:
+        NullLogger(int level): logLevel(level){}
+        bool canHandle(int level) override {
+            return level >= logLevel;
+        }
+        void write(const std::string&) override {}
 };
 
-class Filter {
-public:
-    virtual ~Filter() {}
-    virtual std::vector<File> meetCriteria(const std::vector<File>& files) const = 0;
+enum class SinkType { Null, Console, File };
+enum class LevelDistribution { Uniform, MostlyLow, MostlyHigh };
+
+struct LoggerBenchConfig {
+    int chainLength = 3;
+    LevelDistribution levels = LevelDistribution::Uniform;
+    int producers = 1;
+    SinkType sink = SinkType::Null;
+    bool frozen = false;
+    size_t messagesPerProducer = 100000;
 };
 
-class ExtensionFilter : public Filter {
-private:
-    std::string extension;
+struct LoggerBenchResult {
+    double messagesPerSec;
+    double p50Ns;
+    double p99Ns;
+    double p999Ns;
+};
 
-public:
-    ExtensionFilter(const std::string& extension) : extension(extension) {}
+class LoggerBenchmark {
+    private:
+        static constexpr int levelCount = 4;
+
+        static Logger* makeSink(SinkType type, int level, int index) {
+            switch(type) {
+                case SinkType::Console:
+                    return new ConsoleLogger(level);
+                case SinkType::File:
+                    return new FileLogger(level, "logger_bench_" + std::to_string(index) + ".log");
+                default:
+                    return new NullLogger(level);
+            }
+        }
 
-    std::vector<File> meetCriteria(const std::vector<File>& files) const override {
-        std::vector<File> filteredFiles;
-        for (const auto& file : files) {
-            if (file.getExtension() == extension) {
-                filteredFiles.push_back(file);
+        static int nextLevel(LevelDistribution distribution, uint64_t& state) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            int r = (int)(state % 100);
+            switch(distribution) {
+                case LevelDistribution::MostlyLow:
+                    return r < 90 ? 0 : 1 + r % (levelCount - 1);
+                case LevelDistribution::MostlyHigh:
+                    return r < 90 ? levelCount - 1 : r % (levelCount - 1);
+                default:
+                    return r % levelCount;
             }
         }
-        return filteredFiles;
-    }
-};
 
-class NameFilter : public Filter {
-private:
-    std::string name;
+        static double percentile(std::vector<uint32_t>& samples, double p) {
+            if(samples.empty()) {
+                return 0;
+            }
+            size_t k = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+            std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+            return samples[k];
+        }
 
-public:
-    NameFilter(const std::string& name) : name(name) {}
+    public:
+        static LoggerBenchResult run(const LoggerBenchConfig& config) {
+            std::vector<std::unique_ptr<Logger>> chain;
+            for(int i = 0; i < config.chainLength; ++i) {
+                chain.emplace_back(makeSink(config.sink, i % levelCount, i));
+                if(i > 0) {
+                    chain[i - 1]->setNextLogger(chain[i].get());
+                }
+            }
+            LoggerDispatchTable table(chain[0].get());
+            const std::string msg(64, 'x');
+
+            std::vector<std::vector<uint32_t>> latencies(config.producers);
+            std::vector<std::thread> producers;
+            auto start = std::chrono::steady_clock::now();
+            for(int t = 0; t < config.producers; ++t) {
+                producers.emplace_back([&, t]() {
+                    std::vector<uint32_t>& samples = latencies[t];
+                    samples.reserve(config.messagesPerProducer);
+                    uint64_t state = 0x9E3779B97F4A7C15ull + t;
+                    for(size_t i = 0; i < config.messagesPerProducer; ++i) {
+                        int level = nextLevel(config.levels, state);
+                        auto before = std::chrono::steady_clock::now();
+                        if(config.frozen) {
+                            table.logMessage(level, msg);
+                        } else {
+                            chain[0]->logMessage(level, msg);
+                        }
+                        auto after = std::chrono::steady_clock::now();
+                        samples.push_back((uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(after - before).count());
+                    }
+                });
+            }
+            for(auto& p : producers) {
+                p.join();
+            }
+            chain[0]->flushAll();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    std::vector<File> meetCriteria(const std::vector<File>& files) const override {
-        std::vector<File> filteredFiles;
-        for (const auto& file : files) {
-            if (file.getName() == name) {
-                filteredFiles.push_back(file);
+            std::vector<uint32_t> all;
+            for(auto& samples : latencies) {
+                all.insert(all.end(), samples.begin(), samples.end());
+            }
+            LoggerBenchResult result;
+            result.messagesPerSec = all.size() / seconds;
+            result.p50Ns = percentile(all, 0.50);
+            result.p99Ns = percentile(all, 0.99);
+            result.p999Ns = percentile(all, 0.999);
+
+            if(config.sink == SinkType::File) {
+                chain.clear();
+                for(int i = 0; i < config.chainLength; ++i) {
+                    std::remove(("logger_bench_" + std::to_string(i) + ".log").c_str());
+                }
             }
+            return result;
         }
-        return filteredFiles;
-    }
+
+        static void printHeader(std::ostream& out) {
+            out << "sink\tchain\tlevels\tthreads\tdispatch\tmsg/s\tp50ns\tp99ns\tp999ns\n";
+        }
+
+        static void print(std::ostream& out, const LoggerBenchConfig& config, const LoggerBenchResult& r) {
+            const char* sinkNames[] = {"null", "console", "file"};
+            const char* levelNames[] = {"uniform", "mostly-low", "mostly-high"};
+            out << sinkNames[(int)config.sink] << '\t' << config.chainLength << '\t'
+                << levelNames[(int)config.levels] << '\t' << config.producers << '\t'
+                << (config.frozen ? "table" : "chain") << '\t'
+                << std::fixed << std::setprecision(0) << r.messagesPerSec << '\t'
+                << r.p50Ns << '\t' << r.p99Ns << '\t' << r.p999Ns << '\n';
+        }
+
+        // Every sink, chain length, level mix, producer count and dispatch
+        // mode; it takes a while, so the demo runs a single configuration.
+        // Console is left out, it would flood the terminal.
+        static void sweep(std::ostream& out) {
+            std::vector<int> threadCounts = {1};
+            if(std::thread::hardware_concurrency() > 1) {
+                threadCounts.push_back((int)std::thread::hardware_concurrency());
+            }
+            printHeader(out);
+            for(SinkType sink : {SinkType::Null, SinkType::File}) {
+                for(int chainLength : {1, 4, 16}) {
+                    for(LevelDistribution levels : {LevelDistribution::Uniform, LevelDistribution::MostlyLow}) {
+                        for(int producers : threadCounts) {
+                            for(bool frozen : {false, true}) {
+                                LoggerBenchConfig config;
+                                config.sink = sink;
+                                config.chainLength = chainLength;
+                                config.levels = levels;
+                                config.producers = producers;
+                                config.frozen = frozen;
+                                print(out, config, run(config));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+};
+
+int main() {
+    Logger* conSoleLogger = new ConsoleLogger(1);
+    Logger* fileLogger = new FileLogger(2);
+    Logger* errorLogger = new ErrorLogger(3);
+
+    errorLogger->setNextLogger(fileLogger);
+    fileLogger->setNextLogger(conSoleLogger);
+
+    errorLogger->logMessage(3,"this is a hotel level message");
+    errorLogger->flushAll();
+
+    LoggerDispatchTable dispatch(errorLogger);
+    dispatch.logMessage(2, "this is a file level message");
+    dispatch.logAt<1>("this is a console level message");
+    LOG_AT(dispatch, 3, std::string("this is an error level message"));
+    errorLogger->flushAll();
+
+    AsyncLogger asyncLogger(errorLogger, 1024, OverflowPolicy::DropOldest);
+    asyncLogger.logMessage(1, "this is a console level message");
+    asyncLogger.logMessage(3, "this is an error level message");
+    asyncLogger.shutdown();
+
+    BinaryLogger binaryLogger(1, "app.blog");
+    BINARY_LOG(binaryLogger, 2, "request {} took {} ms", "GET /index", 12.5);
+    BINARY_LOG(binaryLogger, 3, "disk {} is {}% full", 0, 97u);
+    binaryLogger.flush();
+    std::ifstream binaryLog("app.blog", std::ios::binary);
+    BinaryLogDecoder::decode(binaryLog, std::cout);
+
+    // a file-backed chain of four behind the dispatch table; the full
+    // sweep is LoggerBenchmark::sweep(std::cout)
+    LoggerBenchConfig config;
+    config.sink = SinkType::File;
+    config.chainLength = 4;
+    config.levels = LevelDistribution::MostlyLow;
+    config.producers = (int)std::max(1u, std::thread::hardware_concurrency());
+    config.frozen = true;
+    LoggerBenchmark::printHeader(std::cout);
+    LoggerBenchmark::print(std::cout, config, LoggerBenchmark::run(config));
+}
+
+
+
+// Imagine we are building a simple text editor that can execute commands like
+// "write text," "undo the last command," and "redo a command."
+// The Command pattern can encapsulate these actions as objects.
+
+///////////////////////////////
+// Command ////////////////////
+///////////////////////////////
+
+
+enum class EditKind : uint8_t { Insert, Erase };
+
+// What a command does to the document. For an erase only position and
+// length are known up front, the history captures the removed text.
+struct Edit {
+    EditKind kind;
+    size_t position;
+    size_t length;
+    std::string_view text;
+};
+
+// A command can undo itself. CommandManagaer doesn't hold on to them
+// though: its history keeps a compact copy of each command's edit, so
+// undo/redo there never need the object again.
+class Command {
+    public:
+        virtual ~Command() {}
+        virtual void execute() = 0;
+        virtual void undo() = 0;
+        virtual Edit describe() const = 0;
+};
+
+// Piece table stored in a persistent treap. Every node is one piece of
+// either the original text or the append-only add buffer and carries the
+// length of its subtree, so insert/erase at any offset are O(log n).
+// Nodes are never modified once built, so a snapshot is just the root.
+class PieceTable {
+    private:
+        struct Piece;
+        using Node = std::shared_ptr<const Piece>;
+        struct Piece {
+            Node left;
+            Node right;
+            uint32_t priority;
+            bool fromAdd;
+            size_t start;
+            size_t length;
+            size_t total;
+        };
+
+        std::shared_ptr<const std::string> original;
+        std::shared_ptr<std::string> added;
+        Node root;
+
+        // A piece's priority is a hash of where its text starts. Halves of a
+        // split piece then get independent priorities, which keeps the treap
+        // balanced under repeated splits, and it needs no random state.
+        static uint32_t priorityOf(bool fromAdd, size_t start) {
+            uint64_t x = (uint64_t)start * 2 + (fromAdd ? 1 : 0) + 0x9E3779B97F4A7C15ull;
+            x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+            x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+            return (uint32_t)(x ^ (x >> 31));
+        }
+
+        static size_t total(const Node& n) {
+            return n ? n->total : 0;
+        }
+
+        static Node make(const Node& left, const Node& right, uint32_t priority, bool fromAdd, size_t start, size_t length) {
+            std::shared_ptr<Piece> p = std::make_shared<Piece>();
+            p->left = left;
+            p->right = right;
+            p->priority = priority;
+            p->fromAdd = fromAdd;
+            p->start = start;
+            p->length = length;
+            p->total = total(left) + length + total(right);
+            return p;
+        }
+
+        static Node withChildren(const Node& n, const Node& left, const Node& right) {
+            return make(left, right, n->priority, n->fromAdd, n->start, n->length);
+        }
+
+        // l gets the first pos characters, r the rest; a piece straddling pos is cut in two
+        static void split(const Node& n, size_t pos, Node& l, Node& r) {
+            if(!n) {
+                l = r = nullptr;
+                return;
+            }
+            size_t leftTotal = total(n->left);
+            if(pos <= leftTotal) {
+                Node a, b;
+                split(n->left, pos, a, b);
+                l = a;
+                r = withChildren(n, b, n->right);
+            } else if(pos >= leftTotal + n->length) {
+                Node a, b;
+                split(n->right, pos - leftTotal - n->length, a, b);
+                l = withChildren(n, n->left, a);
+                r = b;
+            } else {
+                // the left half starts where n does, so it keeps n's priority
+                size_t cut = pos - leftTotal;
+                l = make(n->left, nullptr, n->priority, n->fromAdd, n->start, cut);
+                Node tail = make(nullptr, nullptr, priorityOf(n->fromAdd, n->start + cut), n->fromAdd, n->start + cut, n->length - cut);
+                r = merge(tail, n->right);
+            }
+        }
+
+        static Node merge(const Node& a, const Node& b) {
+            if(!a) {
+                return b;
+            }
+            if(!b) {
+                return a;
+            }
+            if(a->priority > b->priority) {
+                return withChildren(a, a->left, merge(a->right, b));
+            }
+            return withChildren(b, merge(a, b->left), b->right);
+        }
+
+        static const Piece* rightmost(const Node& n) {
+            const Piece* p = n.get();
+            while(p != nullptr && p->right) {
+                p = p->right.get();
+            }
+            return p;
+        }
+
+        static Node extendRightmost(const Node& n, size_t extra) {
+            if(!n->right) {
+                return make(n->left, nullptr, n->priority, n->fromAdd, n->start, n->length + extra);
+            }
+            return withChildren(n, n->left, extendRightmost(n->right, extra));
+        }
+
+        template<typename Fn>
+        void visit(const Node& n, size_t& skip, size_t& remaining, Fn& fn) const {
+            if(!n || remaining == 0) {
+                return;
+            }
+            size_t leftTotal = total(n->left);
+            if(skip < leftTotal) {
+                visit(n->left, skip, remaining, fn);
+            } else {
+                skip -= leftTotal;
+            }
+            if(remaining == 0) {
+                return;
+            }
+            if(skip < n->length) {
+                size_t count = std::min(n->length - skip, remaining);
+                const std::string& buffer = n->fromAdd ? *added : *original;
+                fn(buffer.data() + n->start + skip, count);
+                remaining -= count;
+                skip = 0;
+            } else {
+                skip -= n->length;
+            }
+            visit(n->right, skip, remaining, fn);
+        }
+
+    public:
+        struct Snapshot {
+            Node root;
+            std::shared_ptr<const std::string> original;
+            std::shared_ptr<std::string> added;
+        };
+
+        explicit PieceTable(std::string text = "")
+            : original(std::make_shared<const std::string>(std::move(text))),
+              added(std::make_shared<std::string>()) {
+            if(!original->empty()) {
+                root = make(nullptr, nullptr, priorityOf(false, 0), false, 0, original->size());
+            }
+        }
+
+        size_t length() const {
+            return total(root);
+        }
+
+        void insert(size_t pos, std::string_view text) {
+            if(text.empty()) {
+                return;
+            }
+            pos = std::min(pos, length());
+            Node l, r;
+            split(root, pos, l, r);
+            const Piece* last = rightmost(l);
+            if(last != nullptr && last->fromAdd && last->start + last->length == added->size()) {
+                // typing at the same spot keeps growing one piece
+                l = extendRightmost(l, text.size());
+            } else {
+                l = merge(l, make(nullptr, nullptr, priorityOf(true, added->size()), true, added->size(), text.size()));
+            }
+            added->append(text.data(), text.size());
+            root = merge(l, r);
+        }
+
+        void erase(size_t pos, size_t count) {
+            pos = std::min(pos, length());
+            count = std::min(count, length() - pos);
+            if(count == 0) {
+                return;
+            }
+            Node l, m, r;
+            split(root, pos, l, r);
+            split(r, count, m, r);
+            root = merge(l, r);
+        }
+
+        // calls fn(const char*, size_t) for each contiguous run of [pos, pos + count)
+        template<typename Fn>
+        void forEachChunk(size_t pos, size_t count, Fn fn) const {
+            size_t skip = pos;
+            size_t remaining = count;
+            visit(root, skip, remaining, fn);
+        }
+
+        template<typename Fn>
+        void forEachChunk(Fn fn) const {
+            forEachChunk(0, length(), fn);
+        }
+
+        std::string getText(size_t pos, size_t count) const {
+            std::string out;
+            out.reserve(std::min(count, length()));
+            forEachChunk(pos, count, [&out](const char* p, size_t n) {
+                out.append(p, n);
+            });
+            return out;
+        }
+
+        std::string getText() const {
+            return getText(0, length());
+        }
+
+        // O(1); the add buffer is shared and only ever appended to
+        Snapshot snapshot() const {
+            return Snapshot{root, original, added};
+        }
+
+        void restore(const Snapshot& snapshot) {
+            root = snapshot.root;
+            original = snapshot.original;
+            added = snapshot.added;
+        }
+};
+
+class TextEditor {
+    private: 
+        PieceTable text;
+    public:
+        TextEditor() {}
+        explicit TextEditor(std::string initial): text(std::move(initial)) {}
+
+        void writeText(std::string_view newText) {
+            text.insert(text.length(), newText);
+        }
+        void removeText(int length) {
+            text.erase(text.length()-std::min((size_t)length, text.length()), length);
+        }
+
+        void insertText(size_t pos, std::string_view newText) {
+            text.insert(pos, newText);
+        }
+        void deleteText(size_t pos, size_t length) {
+            text.erase(pos, length);
+        }
+
+        size_t length() const {
+            return text.length();
+        }
+        std::string getText(size_t pos, size_t length) const {
+            return text.getText(pos, length);
+        }
+        std::string getText() const {
+            return text.getText();
+        }
+
+        template<typename Fn>
+        void forEachChunk(size_t pos, size_t length, Fn fn) const {
+            text.forEachChunk(pos, length, fn);
+        }
+
+        PieceTable::Snapshot snapshot() const {
+            return text.snapshot();
+        }
+        void restore(const PieceTable::Snapshot& snapshot) {
+            text.restore(snapshot);
+        }
+
+        void showText() {
+            text.forEachChunk([](const char* p, size_t n) {
+                std::cout.write(p, n);
+            });
+            std::cout<<std::endl;
+        }
+};
+
+class WriteCommand: public Command {
+    private:
+        TextEditor* textEditor;
+        std::string text;
+        size_t position;
+        size_t applied;   // where execute() put the text
+    public:
+        static constexpr size_t append = (size_t)-1;
+
+        WriteCommand(TextEditor *TextEditor, std::string Text, size_t Position = append)
+            : textEditor(TextEditor), text(std::move(Text)), position(Position), applied(0) {}
+
+    void execute() override {
+        applied = std::min(position, textEditor->length());
+        textEditor->insertText(applied, text);
+    }
+
+    void undo() override {
+        textEditor->deleteText(applied, text.size());
+    }
+
+    Edit describe() const override {
+        return Edit{EditKind::Insert, std::min(position, textEditor->length()), text.size(), text};
+    }
+};
+
+class EraseCommand: public Command {
+    private:
+        TextEditor* textEditor;
+        size_t position;
+        size_t length;
+        size_t applied;
+        std::string removed;
+    public:
+        EraseCommand(TextEditor *TextEditor, size_t Position, size_t Length)
+            : textEditor(TextEditor), position(Position), length(Length), applied(0) {}
+
+    void execute() override {
+        applied = std::min(position, textEditor->length());
+        removed = textEditor->getText(applied, std::min(length, textEditor->length() - applied));
+        textEditor->deleteText(applied, removed.size());
+    }
+
+    void undo() override {
+        textEditor->insertText(applied, removed);
+    }
+
+    Edit describe() const override {
+        size_t start = std::min(position, textEditor->length());
+        return Edit{EditKind::Erase, start, std::min(length, textEditor->length() - start), std::string_view()};
+    }
+};
+
+// Undo history as a tree of revisions, so a new edit after an undo starts
+// a branch instead of throwing the redo side away. Revisions and their text
+// live in two fixed rings allocated once; when either is full the oldest
+// revisions are forgotten. Every checkpointInterval levels a revision keeps
+// an O(1) piece-table snapshot, so jumping to any revision is one restore
+// plus fewer than checkpointInterval edits.
+class CommandHistory {
+    private:
+        static constexpr uint64_t none = (uint64_t)-1;
+        struct Revision {
+            EditKind kind;
+            size_t position;
+            size_t length;
+            uint64_t textStart;    // logical offset into the byte ring
+            uint64_t parent;       // none for a root, which always has a snapshot
+            uint64_t firstChild;
+            uint64_t nextSibling;
+            uint64_t lastChild;    // the branch redo follows
+            uint64_t depth;
+            bool checkpoint;
+        };
+
+        std::vector<Revision> revisions;
+        std::vector<PieceTable::Snapshot> snapshots;  // parallel to revisions
+        std::vector<char> arena;
+        std::vector<uint64_t> path;
+        std::vector<uint64_t> upPath;
+        uint64_t checkpointInterval;
+        uint64_t first;      // oldest revision still kept
+        uint64_t end;        // next revision id
+        uint64_t current;
+        uint64_t arenaEnd;   // logical end of the newest revision's text
+        bool checkpointDue;
+
+        Revision& at(uint64_t id) {
+            return revisions[id % revisions.size()];
+        }
+
+        bool over(uint64_t textEnd) {
+            return first < end && textEnd - at(first).textStart > arena.size();
+        }
+
+        // the oldest revision is always a root; its children become roots
+        // with snapshots rebuilt from its own
+        void evictOldest() {
+            Revision& oldest = at(first);
+            for(uint64_t c = oldest.firstChild; c != none; c = at(c).nextSibling) {
+                TextEditor scratch;
+                scratch.restore(snapshots[first % revisions.size()]);
+                apply(scratch, at(c).kind, at(c).position, text(c));
+                at(c).parent = none;
+                at(c).checkpoint = true;
+                snapshots[c % revisions.size()] = scratch.snapshot();
+            }
+            snapshots[first % revisions.size()] = PieceTable::Snapshot();
+            ++first;
+        }
+
+        void forgetAll() {
+            for(uint64_t id = first; id < end; ++id) {
+                snapshots[id % revisions.size()] = PieceTable::Snapshot();
+            }
+            first = end;
+        }
+
+        std::string_view text(uint64_t id) {
+            Revision& r = at(id);
+            return std::string_view(&arena[r.textStart % arena.size()], r.length);
+        }
+
+        Edit edit(uint64_t id) {
+            Revision& r = at(id);
+            return Edit{r.kind, r.position, r.length, text(id)};
+        }
+
+    public:
+        CommandHistory(const PieceTable::Snapshot& initial, size_t maxRevisions, size_t budgetBytes, size_t checkpointEvery = 64)
+            : revisions(std::max((size_t)2, maxRevisions)), snapshots(revisions.size()),
+              arena(std::max((size_t)1, budgetBytes)), checkpointInterval(std::max((size_t)1, checkpointEvery)),
+              first(0), end(1), current(0), arenaEnd(0), checkpointDue(false) {
+            revisions[0] = Revision{EditKind::Insert, 0, 0, 0, none, none, none, none, 0, true};
+            snapshots[0] = initial;
+        }
+
+        static void apply(TextEditor& editor, EditKind kind, size_t position, std::string_view text) {
+            if(kind == EditKind::Insert) {
+                editor.insertText(position, text);
+            } else {
+                editor.deleteText(position, text.size());
+            }
+        }
+
+        // Records a child of the current revision and makes it current.
+        // fill(char* dest) writes the edit's length bytes. An insert that
+        // continues the newest revision is merged into it, so a typing run
+        // undoes as one step.
+        template<typename Fill>
+        void push(EditKind kind, size_t position, size_t length, Fill fill) {
+            Revision& cur = at(current);
+            if(current == end - 1 && cur.parent != none && kind == EditKind::Insert &&
+               cur.kind == EditKind::Insert && cur.position + cur.length == position &&
+               cur.textStart % arena.size() + cur.length + length <= arena.size()) {
+                while(first != current && over(arenaEnd + length)) {
+                    evictOldest();
+                }
+                if(!over(arenaEnd + length) && at(current).parent != none) {
+                    fill(&arena[arenaEnd % arena.size()]);
+                    at(current).length += length;
+                    arenaEnd += length;
+                    checkpointDue = at(current).checkpoint;
+                    return;
+                }
+            }
+
+            uint64_t start = arenaEnd;
+            if(start % arena.size() + length > arena.size()) {
+                start += arena.size() - start % arena.size();
+            }
+            // when the budget can't keep the current revision the history restarts here
+            bool restart = length > arena.size();
+            while(!restart && first < end && (end - first == revisions.size() || over(start + length))) {
+                if(first == current) {
+                    restart = true;
+                } else {
+                    evictOldest();
+                }
+            }
+            if(restart) {
+                forgetAll();
+                start = arenaEnd;
+            }
+
+            uint64_t id = end++;
+            Revision& r = at(id);
+            r = Revision{kind, position, restart ? 0 : length, start, none, none, none, none, 0, false};
+            if(!restart) {
+                Revision& parent = at(current);
+                r.parent = current;
+                r.depth = parent.depth + 1;
+                r.nextSibling = parent.firstChild;
+                parent.firstChild = id;
+                parent.lastChild = id;
+                fill(&arena[start % arena.size()]);
+                arenaEnd = start + length;
+            }
+            current = id;
+            checkpointDue = r.parent == none || r.depth % checkpointInterval == 0;
+        }
+
+        // after applying a pushed edit, hand over the editor's snapshot if asked for one
+        bool wantsCheckpoint() const {
+            return checkpointDue;
+        }
+
+        void setCheckpoint(const PieceTable::Snapshot& snapshot) {
+            at(current).checkpoint = true;
+            snapshots[current % revisions.size()] = snapshot;
+            checkpointDue = false;
+        }
+
+        bool canUndo() {
+            return at(current).parent != none;
+        }
+
+        bool canRedo() {
+            uint64_t child = at(current).lastChild;
+            return child != none && child >= first && child < end && at(child).parent == current;
+        }
+
+        // returns the edit to revert and moves to the parent
+        Edit stepBack() {
+            Edit e = edit(current);
+            uint64_t parent = at(current).parent;
+            at(parent).lastChild = current;
+            current = parent;
+            return e;
+        }
+
+        Edit stepForward() {
+            current = at(current).lastChild;
+            return edit(current);
+        }
+
+        bool contains(uint64_t id) const {
+            return id >= first && id < end;
+        }
+
+        // moves to target: restores the nearest checkpoint on its ancestry
+        // (or starts from the current revision if that is on the way) and
+        // replays the edits down from there
+        void jumpTo(uint64_t target, TextEditor& editor) {
+            path.clear();
+            uint64_t node = target;
+            while(node != current && !at(node).checkpoint) {
+                path.push_back(node);
+                node = at(node).parent;
+            }
+            if(node != current) {
+                editor.restore(snapshots[node % revisions.size()]);
+            }
+            for(size_t i = path.size(); i-- > 0;) {
+                Edit e = edit(path[i]);
+                apply(editor, e.kind, e.position, e.text);
+                at(at(path[i]).parent).lastChild = path[i];
+            }
+            current = target;
+        }
+
+        // Calls fn(kind, position, text) for each edit that takes the document
+        // from the current revision to target: the reverted side up to their
+        // common ancestor, then the replayed side down to target. Returns
+        // false without calling fn when the revisions share no ancestor or
+        // more than limit edits would be needed.
+        template<typename Fn>
+        bool diffTo(uint64_t target, size_t limit, Fn fn) {
+            upPath.clear();
+            path.clear();
+            uint64_t a = current;
+            uint64_t b = target;
+            while(a != b) {
+                if(a == none || b == none || upPath.size() + path.size() >= limit) {
+                    return false;
+                }
+                if(at(a).depth >= at(b).depth) {
+                    upPath.push_back(a);
+                    a = at(a).parent;
+                } else {
+                    path.push_back(b);
+                    b = at(b).parent;
+                }
+            }
+            for(uint64_t id : upPath) {
+                Edit e = edit(id);
+                fn(e.kind == EditKind::Insert ? EditKind::Erase : EditKind::Insert, e.position, e.text);
+            }
+            for(size_t i = path.size(); i-- > 0;) {
+                Edit e = edit(path[i]);
+                fn(e.kind, e.position, e.text);
+            }
+            return true;
+        }
+
+        uint64_t currentRevision() const {
+            return current;
+        }
+
+        uint64_t oldestRevision() const {
+            return first;
+        }
+
+        uint64_t newestRevision() const {
+            return end - 1;
+        }
+};
+
+// CRC-32 (IEEE 802.3), table driven.
+class Crc32 {
+    private:
+        static const uint32_t* table() {
+            static uint32_t entries[256];
+            static bool ready = false;
+            if(!ready) {
+                for(uint32_t i = 0; i < 256; ++i) {
+                    uint32_t c = i;
+                    for(int k = 0; k < 8; ++k) {
+                        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                    }
+                    entries[i] = c;
+                }
+                ready = true;
+            }
+            return entries;
+        }
+    public:
+        static uint32_t compute(const void* data, size_t size, uint32_t crc = 0) {
+            static const uint32_t* t = table();
+            const unsigned char* p = (const unsigned char*)data;
+            crc = ~crc;
+            for(size_t i = 0; i < size; ++i) {
+                crc = t[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+            }
+            return ~crc;
+        }
+};
+
+// Append-only journal of every change made to the document, written into
+// a memory-mapped file so an append is a memcpy. Each record carries a
+// CRC, which is how recovery finds the end of a torn tail. Every
+// snapshotEvery records the journal is compacted into a new file holding
+// just a full-text snapshot, so recovery never replays more than that.
+//
+// File: "CJNL" u32 version u64 reserved, then records of
+//   u32 payload length (0 ends the journal) u32 crc payload
+// where the payload is u8 type u64 position and
+//   Insert: text   Erase: u64 length   Snapshot: text
+class CommandJournal {
+    private:
+        enum RecordType : uint8_t { InsertRecord = 1, EraseRecord = 2, SnapshotRecord = 3 };
+        static constexpr size_t headerSize = 16;
+        static constexpr uint32_t version = 1;
+
+        std::string path;
+        size_t snapshotEvery;
+        int fd;
+        char* base;
+        size_t mappedSize;
+        size_t writePos;
+        size_t lastSnapshot;
+        size_t sinceSnapshot;
+
+        bool map(size_t size) {
+            if(base != nullptr) {
+                ::munmap(base, mappedSize);
+                base = nullptr;
+            }
+            if(::ftruncate(fd, size) != 0) {
+                std::perror(path.c_str());
+                return false;
+            }
+            void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(p == MAP_FAILED) {
+                std::perror(path.c_str());
+                return false;
+            }
+            base = (char*)p;
+            mappedSize = size;
+            return true;
+        }
+
+        bool openAt(const std::string& file) {
+            fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if(fd < 0) {
+                std::perror(file.c_str());
+                return false;
+            }
+            struct stat st;
+            ::fstat(fd, &st);
+            bool fresh = (size_t)st.st_size < headerSize;
+            if(!map(std::max((size_t)st.st_size, (size_t)1 << 20))) {
+                return false;
+            }
+            if(fresh) {
+                std::memcpy(base, "CJNL", 4);
+                std::memcpy(base + 4, &version, 4);
+                std::memset(base + 8, 0, 8);
+            } else if(std::memcmp(base, "CJNL", 4) != 0) {
+                std::cerr << file << ": not a command journal\n";
+                return false;
+            }
+            writePos = headerSize;
+            lastSnapshot = headerSize;
+            return true;
+        }
+
+        // calls fn(type, position, payload after position, size, offset) for
+        // every intact record from pos on and stops at the first torn one
+        template<typename Fn>
+        size_t scan(size_t pos, Fn fn) const {
+            while(pos + 8 <= mappedSize) {
+                uint32_t length, crc;
+                std::memcpy(&length, base + pos, 4);
+                std::memcpy(&crc, base + pos + 4, 4);
+                if(length < 9 || pos + 8 + length > mappedSize || Crc32::compute(base + pos + 8, length) != crc) {
+                    break;
+                }
+                const char* payload = base + pos + 8;
+                uint64_t position;
+                std::memcpy(&position, payload + 1, 8);
+                fn((uint8_t)payload[0], position, payload + 9, (size_t)length - 9, pos);
+                pos += 8 + length;
+            }
+            return pos;
+        }
+
+        char* reserve(size_t payload) {
+            size_t needed = writePos + 8 + payload + 8;  // keep room for the zero terminator
+            if(needed > mappedSize && !map(std::max(mappedSize * 2, needed))) {
+                return nullptr;
+            }
+            return base + writePos;
+        }
+
+        void commit(char* record, uint32_t payload) {
+            uint32_t crc = Crc32::compute(record + 8, payload);
+            std::memcpy(record + 4, &crc, 4);
+            // the length goes last, a record is invisible until it is complete
+            std::memcpy(record, &payload, 4);
+            writePos += 8 + payload;
+        }
+
+        template<typename Chunks>
+        void writeRecord(uint8_t type, uint64_t position, size_t textLength, Chunks chunks) {
+            uint32_t payload = (uint32_t)(9 + textLength);
+            char* record = reserve(payload);
+            if(record == nullptr) {
+                return;
+            }
+            record[8] = (char)type;
+            std::memcpy(record + 9, &position, 8);
+            char* dest = record + 17;
+            chunks([&dest](const char* p, size_t n) {
+                std::memcpy(dest, p, n);
+                dest += n;
+            });
+            commit(record, payload);
+        }
+
+    public:
+        CommandJournal(const std::string& path, size_t snapshotEvery = 1 << 20)
+            : path(path), snapshotEvery(snapshotEvery), fd(-1), base(nullptr), mappedSize(0),
+              writePos(0), lastSnapshot(0), sinceSnapshot(0) {
+            if(!openAt(path)) {
+                close();
+                return;
+            }
+            writePos = scan(headerSize, [this](uint8_t type, uint64_t, const char*, size_t, size_t offset) {
+                if(type == SnapshotRecord) {
+                    lastSnapshot = offset;
+                    sinceSnapshot = 0;
+                } else {
+                    ++sinceSnapshot;
+                }
+            });
+        }
+
+        ~CommandJournal() {
+            close();
+        }
+
+        void close() {
+            if(base != nullptr) {
+                ::munmap(base, mappedSize);
+                base = nullptr;
+            }
+            if(fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+
+        bool isOpen() const {
+            return base != nullptr;
+        }
+
+        void appendEdit(EditKind kind, size_t position, size_t length, std::string_view text) {
+            if(!isOpen()) {
+                return;
+            }
+            if(kind == EditKind::Insert) {
+                writeRecord(InsertRecord, position, text.size(), [&text](auto sink) {
+                    sink(text.data(), text.size());
+                });
+            } else {
+                uint64_t count = length;
+                writeRecord(EraseRecord, position, 8, [&count](auto sink) {
+                    sink((const char*)&count, 8);
+                });
+            }
+            ++sinceSnapshot;
+        }
+
+        bool wantsSnapshot() const {
+            return isOpen() && sinceSnapshot >= snapshotEvery;
+        }
+
+        size_t snapshotInterval() const {
+            return snapshotEvery;
+        }
+
+        // starts a new journal holding only the editor's full text; the
+        // rename makes the switch atomic, a crash leaves one file or the other
+        void compact(const TextEditor& editor) {
+            if(!isOpen()) {
+                return;
+            }
+            std::string next = path + ".compact";
+            close();
+            std::remove(next.c_str());
+            if(!openAt(next)) {
+                close();
+                return;
+            }
+            writeRecord(SnapshotRecord, 0, editor.length(), [&editor](auto sink) {
+                editor.forEachChunk(0, editor.length(), sink);
+            });
+            ::msync(base, writePos, MS_SYNC);
+            std::rename(next.c_str(), path.c_str());
+            sinceSnapshot = 0;
+        }
+
+        // asks the kernel to write dirty pages back without waiting
+        void sync() {
+            if(isOpen()) {
+                ::msync(base, mappedSize, MS_ASYNC);
+            }
+        }
+
+        // Rebuilds the document from the latest snapshot plus every edit after
+        // it and returns the number of records replayed. Runs of adjacent
+        // inserts (and erases inside such a run) are folded together first,
+        // so a typing session reaches the piece table as a few large inserts.
+        size_t recover(TextEditor& editor) const {
+            if(!isOpen()) {
+                return 0;
+            }
+            editor = TextEditor();
+            std::string pending;
+            size_t pendingPos = 0;
+            auto flushPending = [&]() {
+                if(!pending.empty()) {
+                    editor.insertText(pendingPos, pending);
+                    pending.clear();
+                }
+            };
+            size_t replayed = 0;
+            scan(lastSnapshot, [&](uint8_t type, uint64_t position, const char* data, size_t size, size_t) {
+                if(type == SnapshotRecord) {
+                    pending.clear();
+                    editor = TextEditor(std::string(data, size));
+                } else if(type == InsertRecord) {
+                    if(pending.empty() || position != pendingPos + pending.size()) {
+                        flushPending();
+                        pendingPos = position;
+                    }
+                    pending.append(data, size);
+                } else if(type == EraseRecord) {
+                    uint64_t count;
+                    std::memcpy(&count, data, 8);
+                    if(position >= pendingPos && position + count <= pendingPos + pending.size()) {
+                        pending.erase(position - pendingPos, count);
+                    } else {
+                        flushPending();
+                        editor.deleteText(position, count);
+                    }
+                }
+                ++replayed;
+            });
+            flushPending();
+            return replayed;
+        }
+};
+
+class CommandManagaer {
+    private:
+        TextEditor* textEditor;
+        CommandHistory history;
+        CommandJournal* journal;
+
+        void apply(EditKind kind, size_t position, std::string_view text) {
+            CommandHistory::apply(*textEditor, kind, position, text);
+            journalEdit(kind, position, text.size(), text);
+        }
+
+        void journalEdit(EditKind kind, size_t position, size_t length, std::string_view text) {
+            if(journal == nullptr) {
+                return;
+            }
+            journal->appendEdit(kind, position, length, text);
+            if(journal->wantsSnapshot()) {
+                journal->compact(*textEditor);
+            }
+        }
+
+        static EditKind inverse(EditKind kind) {
+            return kind == EditKind::Insert ? EditKind::Erase : EditKind::Insert;
+        }
+
+        void checkpoint() {
+            if(history.wantsCheckpoint()) {
+                history.setCheckpoint(textEditor->snapshot());
+            }
+        }
+
+    public:
+        CommandManagaer(TextEditor* editor, size_t maxRevisions = 4096, size_t budgetBytes = 1 << 20, size_t checkpointEvery = 64)
+            : textEditor(editor), history(editor->snapshot(), maxRevisions, budgetBytes, checkpointEvery), journal(nullptr) {}
+
+        // from here on every change to the document is journaled; the journal
+        // starts from a snapshot of the current text
+        void attachJournal(CommandJournal* commandJournal) {
+            journal = commandJournal;
+            if(journal != nullptr) {
+                journal->compact(*textEditor);
+            }
+        }
+
+        void executeCommand(Command& command) {
+            Edit edit = command.describe();
+            history.push(edit.kind, edit.position, edit.length, [&](char* dest) {
+                if(edit.kind == EditKind::Insert) {
+                    std::memcpy(dest, edit.text.data(), edit.length);
+                } else {
+                    textEditor->forEachChunk(edit.position, edit.length, [&dest](const char* p, size_t n) {
+                        std::memcpy(dest, p, n);
+                        dest += n;
+                    });
+                }
+            });
+            command.execute();
+            checkpoint();
+            journalEdit(edit.kind, edit.position, edit.length, edit.text);
+        }
+
+        bool undo() {
+            if(!history.canUndo()) {
+                return false;
+            }
+            Edit edit = history.stepBack();
+            apply(inverse(edit.kind), edit.position, edit.text);
+            return true;
+        }
+
+        bool redoCommand() {
+            if(!history.canRedo()) {
+                return false;
+            }
+            Edit edit = history.stepForward();
+            apply(edit.kind, edit.position, edit.text);
+            return true;
+        }
+
+        // The journal gets the edits between the two revisions, so browsing
+        // costs I/O proportional to the distance travelled; it is compacted
+        // only when that distance alone would pass its snapshot interval.
+        bool gotoRevision(uint64_t revision) {
+            if(!history.contains(revision)) {
+                return false;
+            }
+            bool journaled = journal == nullptr || history.diffTo(revision, journal->snapshotInterval(),
+                [this](EditKind kind, size_t position, std::string_view text) {
+                    journal->appendEdit(kind, position, text.size(), text);
+                });
+            history.jumpTo(revision, *textEditor);
+            if(journal != nullptr && (!journaled || journal->wantsSnapshot())) {
+                journal->compact(*textEditor);
+            }
+            return true;
+        }
+
+        uint64_t currentRevision() const {
+            return history.currentRevision();
+        }
+};
+
+// Several threads editing one document. Producers push requests into the
+// lock-free BoundedQueue and return; one sequencer thread drains it in
+// batches, gives every edit the next sequence number and applies it through
+// the CommandManagaer, which stays single threaded. Undo is per client: the
+// client's last edit is inverted and then shifted past every edit applied
+// after it, so other clients' text is left alone.
+struct EditRequest {
+    enum class Type : uint8_t { Insert, Erase, Undo };
+    Type type;
+    uint32_t client;
+    size_t position;
+    size_t length;
+    std::string text;
+};
+
+class EditSequencer {
+    private:
+        // an applied edit, kept for a window so undo can be transformed past later ones
+        struct Applied {
+            uint32_t client;
+            EditKind kind;
+            size_t position;
+            size_t length;
+            std::string removed;  // erased text, to put back on undo
+        };
+        struct Segment {
+            size_t start;
+            size_t end;
+        };
+
+        TextEditor* textEditor;
+        CommandManagaer* manager;
+        size_t batchSize;
+        size_t undoWindow;
+        BoundedQueue<EditRequest> queue;
+        std::atomic<bool> running;
+        std::atomic<int> activeProducers;
+        std::atomic<size_t> pushed;
+        std::atomic<size_t> completed;
+        std::atomic<bool> parked;
+        std::atomic<int> flushWaiters;
+        std::mutex parkLock;
+        std::condition_variable wakeWorker;
+        std::condition_variable wakeFlushers;
+        std::thread worker;
+
+        // owned by the sequencer thread
+        std::vector<Applied> log;      // ring, log[seq % undoWindow]
+        uint64_t nextSeq;
+        std::unordered_map<uint32_t, std::deque<uint64_t>> undoStacks;
+        std::vector<Segment> segments;
+
+        Applied& logAt(uint64_t seq) {
+            return log[seq % undoWindow];
+        }
+
+        bool pending() const {
+            return completed.load() != pushed.load();
+        }
+
+        uint64_t oldestSeq() const {
+            return nextSeq > undoWindow ? nextSeq - undoWindow : 0;
+        }
+
+        // where position x ends up after an erase of [q, q + m)
+        static size_t afterErase(size_t x, size_t q, size_t m) {
+            if(x <= q) {
+                return x;
+            }
+            return x <= q + m ? q : x - m;
+        }
+
+        uint64_t record(uint32_t client, const Edit& edit, std::string removed) {
+            uint64_t seq = nextSeq++;
+            logAt(seq) = Applied{client, edit.kind, edit.position, edit.length, std::move(removed)};
+            return seq;
+        }
+
+        // edits that fell out of the window can no longer be undone, so a
+        // client that never undoes holds at most undoWindow entries
+        void pushUndo(uint32_t client, uint64_t seq) {
+            std::deque<uint64_t>& stack = undoStacks[client];
+            stack.push_back(seq);
+            while(stack.front() < oldestSeq()) {
+                stack.pop_front();
+            }
+        }
+
+        void applyInsert(uint32_t client, size_t position, std::string_view text, bool undoable) {
+            WriteCommand command(textEditor, std::string(text), position);
+            Edit edit = command.describe();
+            manager->executeCommand(command);
+            uint64_t seq = record(client, edit, std::string());
+            if(undoable) {
+                pushUndo(client, seq);
+            }
+        }
+
+        void applyErase(uint32_t client, size_t position, size_t length, bool undoable) {
+            EraseCommand command(textEditor, position, length);
+            Edit edit = command.describe();
+            std::string removed = textEditor->getText(edit.position, edit.length);
+            manager->executeCommand(command);
+            uint64_t seq = record(client, edit, std::move(removed));
+            if(undoable) {
+                pushUndo(client, seq);
+            }
+        }
+
+        void undo(uint32_t client) {
+            std::deque<uint64_t>& stack = undoStacks[client];
+            if(!stack.empty() && stack.back() < oldestSeq()) {
+                stack.clear();  // older than the window, nothing left to undo
+            }
+            if(stack.empty()) {
+                return;
+            }
+            uint64_t seq = stack.back();
+            stack.pop_back();
+            Applied target = logAt(seq);
+            if(target.kind == EditKind::Erase) {
+                // put the text back, at wherever its position has moved to
+                size_t position = target.position;
+                for(uint64_t later = seq + 1; later < nextSeq; ++later) {
+                    Applied& e = logAt(later);
+                    if(e.kind == EditKind::Insert) {
+                        position += e.position <= position ? e.length : 0;
+                    } else {
+                        position = afterErase(position, e.position, e.length);
+                    }
+                }
+                applyInsert(client, position, target.removed, false);
+                return;
+            }
+            // remove the inserted characters that still exist; inserts made
+            // inside them later split the range
+            segments.clear();
+            segments.push_back(Segment{target.position, target.position + target.length});
+            for(uint64_t later = seq + 1; later < nextSeq; ++later) {
+                Applied& e = logAt(later);
+                for(size_t i = 0; i < segments.size(); ++i) {
+                    Segment& seg = segments[i];
+                    if(e.kind == EditKind::Erase) {
+                        seg.start = afterErase(seg.start, e.position, e.length);
+                        seg.end = afterErase(seg.end, e.position, e.length);
+                    } else if(e.position <= seg.start) {
+                        seg.start += e.length;
+                        seg.end += e.length;
+                    } else if(e.position < seg.end) {
+                        Segment tail{e.position + e.length, seg.end + e.length};
+                        seg.end = e.position;
+                        segments.insert(segments.begin() + i + 1, tail);
+                        ++i;
+                    }
+                }
+            }
+            // back to front so earlier positions stay valid
+            for(size_t i = segments.size(); i-- > 0;) {
+                if(segments[i].end > segments[i].start) {
+                    applyErase(client, segments[i].start, segments[i].end - segments[i].start, false);
+                }
+            }
+        }
+
+        void apply(EditRequest& request) {
+            switch(request.type) {
+                case EditRequest::Type::Insert:
+                    applyInsert(request.client, request.position, request.text, true);
+                    break;
+                case EditRequest::Type::Erase:
+                    applyErase(request.client, request.position, request.length, true);
+                    break;
+                case EditRequest::Type::Undo:
+                    undo(request.client);
+                    break;
+            }
+        }
+
+        void sequenceLoop() {
+            std::vector<EditRequest> batch;
+            batch.reserve(batchSize);
+            for(;;) {
+                EditRequest request;
+                while(batch.size() < batchSize && queue.tryPop(request)) {
+                    batch.push_back(std::move(request));
+                }
+                if(!batch.empty()) {
+                    for(auto& r : batch) {
+                        apply(r);
+                    }
+                    completed.fetch_add(batch.size());
+                    batch.clear();
+                    if(flushWaiters.load() > 0) {
+                        std::lock_guard<std::mutex> guard(parkLock);
+                        wakeFlushers.notify_all();
+                    }
+                    continue;
+                }
+                if(!running.load()) {
+                    if(activeProducers.load() == 0 && !pending()) {
+                        return;
+                    }
+                    std::this_thread::yield();
+                    continue;
+                }
+                // same handshake as AsyncLogger: pending() or parked, one of them is seen
+                std::unique_lock<std::mutex> guard(parkLock);
+                parked.store(true);
+                wakeWorker.wait(guard, [this]() { return pending() || !running.load(); });
+                parked.store(false);
+            }
+        }
+
+        bool submit(EditRequest&& request) {
+            activeProducers.fetch_add(1);
+            if(!running.load()) {
+                activeProducers.fetch_sub(1);
+                return false;
+            }
+            pushed.fetch_add(1);
+            while(!queue.tryPush(std::move(request))) {
+                std::this_thread::yield();
+            }
+            if(parked.load()) {
+                std::lock_guard<std::mutex> guard(parkLock);
+                wakeWorker.notify_one();
+            }
+            activeProducers.fetch_sub(1);
+            return true;
+        }
+
+    public:
+        EditSequencer(TextEditor* editor, CommandManagaer* commandManager, size_t capacity = 1 << 14,
+                      size_t batchSize = 512, size_t undoWindow = 1 << 16)
+            : textEditor(editor), manager(commandManager), batchSize(batchSize), undoWindow(std::max((size_t)1, undoWindow)),
+              queue(capacity), running(true), activeProducers(0), pushed(0), completed(0),
+              parked(false), flushWaiters(0),
+              log(this->undoWindow), nextSeq(0) {
+            worker = std::thread(&EditSequencer::sequenceLoop, this);
+        }
+
+        ~EditSequencer() {
+            stop();
+        }
+
+        // Positions refer to the document as it is when the edit is applied.
+        bool submitInsert(uint32_t client, size_t position, std::string text) {
+            return submit(EditRequest{EditRequest::Type::Insert, client, position, text.size(), std::move(text)});
+        }
+
+        bool submitErase(uint32_t client, size_t position, size_t length) {
+            return submit(EditRequest{EditRequest::Type::Erase, client, position, length, std::string()});
+        }
+
+        bool submitUndo(uint32_t client) {
+            return submit(EditRequest{EditRequest::Type::Undo, client, 0, 0, std::string()});
+        }
+
+        // blocks until everything submitted so far has been applied; the
+        // editor may be read after this while no one is submitting
+        void flush() {
+            flushWaiters.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> guard(parkLock);
+                wakeFlushers.wait(guard, [this]() { return completed.load() >= pushed.load(); });
+            }
+            flushWaiters.fetch_sub(1);
+        }
+
+        void stop() {
+            if(!running.exchange(false)) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> guard(parkLock);
+                wakeWorker.notify_one();
+            }
+            worker.join();
+        }
+};
+
+// Randomized checks of the editor against plain std::string models. Each
+// one returns false at the first state that differs.
+class EditorChecks {
+    private:
+        static uint64_t next(uint64_t& state) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        }
+
+        static std::string word(uint64_t& state) {
+            return std::string(1 + next(state) % 5, (char)('a' + next(state) % 26));
+        }
+    public:
+        // random inserts and erases, with snapshots taken along the way
+        // restored at the end
+        static bool pieceTable(uint64_t seed, int steps) {
+            uint64_t state = seed | 1;
+            std::string model = "hello world";
+            TextEditor editor(model);
+            std::vector<std::pair<PieceTable::Snapshot, std::string>> snapshots;
+            for(int i = 0; i < steps; ++i) {
+                size_t pos = next(state) % (model.size() + 1);
+                if(next(state) % 3 < 2) {
+                    std::string text = word(state);
+                    model.insert(pos, text);
+                    editor.insertText(pos, text);
+                } else {
+                    size_t length = next(state) % 8;
+                    model.erase(pos, length);
+                    editor.deleteText(pos, length);
+                }
+                if(i % 1000 == 0) {
+                    snapshots.push_back({editor.snapshot(), model});
+                }
+                if(editor.length() != model.size() || (i % 97 == 0 && editor.getText() != model)) {
+                    return false;
+                }
+                size_t from = next(state) % (model.size() + 1), length = next(state) % 16;
+                if(editor.getText(from, length) != model.substr(from, length)) {
+                    return false;
+                }
+            }
+            for(const auto& [snapshot, text] : snapshots) {
+                TextEditor restored;
+                restored.restore(snapshot);
+                if(restored.getText() != text) {
+                    return false;
+                }
+            }
+            return editor.getText() == model;
+        }
+
+        // random edits, undo, redo and jumps through a small history that
+        // keeps evicting; every revision reached again must show the text
+        // it had when it was last current
+        static bool revisions(uint64_t seed, int steps) {
+            uint64_t state = seed | 1;
+            TextEditor editor;
+            CommandManagaer manager(&editor, 1 + next(state) % 32, 256 + next(state) % 4096, 1 + next(state) % 16);
+            std::unordered_map<uint64_t, std::string> seen;
+            std::vector<uint64_t> visited;
+            seen[manager.currentRevision()] = "";
+            for(int i = 0; i < steps; ++i) {
+                uint64_t op = next(state) % 10;
+                bool moved = false;
+                if(op < 4) {
+                    size_t pos = next(state) % 2 ? WriteCommand::append : next(state) % (editor.length() + 1);
+                    WriteCommand command(&editor, word(state), pos);
+                    manager.executeCommand(command);
+                } else if(op < 5) {
+                    EraseCommand command(&editor, next(state) % (editor.length() + 1), next(state) % 6);
+                    manager.executeCommand(command);
+                } else if(op < 7) {
+                    moved = manager.undo();
+                } else if(op < 8) {
+                    moved = manager.redoCommand();
+                } else if(!visited.empty()) {
+                    uint64_t target = visited[next(state) % visited.size()];
+                    moved = manager.gotoRevision(target);
+                    if(moved && manager.currentRevision() != target) {
+                        return false;
+                    }
+                }
+                auto known = seen.find(manager.currentRevision());
+                if(moved && (known == seen.end() || known->second != editor.getText())) {
+                    return false;
+                }
+                seen[manager.currentRevision()] = editor.getText();
+                visited.push_back(manager.currentRevision());
+            }
+            while(manager.redoCommand()) {}
+            std::string last = editor.getText();
+            while(manager.undo()) {
+                auto known = seen.find(manager.currentRevision());
+                if(known == seen.end() || known->second != editor.getText()) {
+                    return false;
+                }
+            }
+            while(manager.redoCommand()) {}
+            return editor.getText() == last;
+        }
+
+        // random edits and history moves journaled to path, which is
+        // reopened and recovered every few steps as if after a crash
+        static bool journalRecover(const std::string& path, uint64_t seed, int steps) {
+            uint64_t state = seed | 1;
+            std::remove(path.c_str());
+            TextEditor editor;
+            CommandManagaer manager(&editor, 64, 4096, 4);
+            CommandJournal journal(path, 1 + next(state) % 256);
+            manager.attachJournal(&journal);
+            std::vector<uint64_t> visited;
+            bool ok = true;
+            for(int i = 0; ok && i < steps; ++i) {
+                uint64_t op = next(state) % 10;
+                if(op < 4) {
+                    WriteCommand command(&editor, word(state), next(state) % (editor.length() + 2));
+                    manager.executeCommand(command);
+                } else if(op < 5) {
+                    EraseCommand command(&editor, next(state) % (editor.length() + 1), next(state) % 6);
+                    manager.executeCommand(command);
+                } else if(op < 7) {
+                    manager.undo();
+                } else if(op < 8) {
+                    manager.redoCommand();
+                } else if(!visited.empty()) {
+                    manager.gotoRevision(visited[next(state) % visited.size()]);
+                }
+                visited.push_back(manager.currentRevision());
+                if(i % 7 == 0 || i == steps - 1) {
+                    journal.sync();
+                    CommandJournal reopened(path);
+                    TextEditor recovered;
+                    reopened.recover(recovered);
+                    ok = recovered.getText() == editor.getText();
+                }
+            }
+            return ok;
+        }
+};
+
+int main() {
+    TextEditor textEditor;
+    CommandManagaer commandManager(&textEditor);
+    WriteCommand command1(&textEditor, "hello");
+    WriteCommand command2(&textEditor, " world");
+    EraseCommand command3(&textEditor, 0, 6);
+
+    commandManager.executeCommand(command1);
+    textEditor.showText();
+    // appends right after "hello", so it merges into the same undo entry
+    commandManager.executeCommand(command2);
+    textEditor.showText();
+    commandManager.executeCommand(command3);
+    textEditor.showText();
+    commandManager.undo();
+    textEditor.showText();
+    commandManager.undo();
+    textEditor.showText();
+    commandManager.redoCommand();
+    textEditor.showText();
+
+    // a new edit after an undo branches off instead of dropping the redo side
+    uint64_t helloWorld = commandManager.currentRevision();
+    commandManager.undo();
+    WriteCommand command4(&textEditor, "!");
+    commandManager.executeCommand(command4);
+    textEditor.showText();
+    commandManager.gotoRevision(helloWorld);
+    textEditor.showText();
+
+    // a command still undoes itself when used without the manager
+    TextEditor scratch("hello");
+    EraseCommand trim(&scratch, 0, 2);
+    trim.execute();
+    scratch.showText();
+    trim.undo();
+    scratch.showText();
+
+    // everything from here on survives a crash
+    CommandJournal journal("editor.journal");
+    commandManager.attachJournal(&journal);
+    WriteCommand command5(&textEditor, ", again");
+    commandManager.executeCommand(command5);
+    commandManager.undo();
+    commandManager.redoCommand();
+
+    TextEditor recovered;
+    CommandJournal reopened("editor.journal");
+    reopened.recover(recovered);
+    recovered.showText();
+
+    // two clients typing into the same document from their own threads
+    TextEditor shared;
+    CommandManagaer sharedManager(&shared);
+    EditSequencer sequencer(&shared, &sharedManager);
+    std::thread alice([&sequencer]() {
+        sequencer.submitInsert(1, 0, "alice ");
+    });
+    std::thread bob([&sequencer]() {
+        sequencer.submitInsert(2, WriteCommand::append, "bob ");
+    });
+    alice.join();
+    bob.join();
+    sequencer.submitInsert(1, WriteCommand::append, "again");
+    sequencer.submitUndo(2);   // removes only bob's text
+    sequencer.flush();
+    shared.showText();
+
+    std::cout << "piece table check: " << (EditorChecks::pieceTable(1, 20000) ? "ok" : "FAILED") << std::endl;
+    bool revisionsOk = true;
+    for(uint64_t seed = 1; seed <= 50; ++seed) {
+        revisionsOk = revisionsOk && EditorChecks::revisions(seed, 300);
+    }
+    std::cout << "revision check: " << (revisionsOk ? "ok" : "FAILED") << std::endl;
+    bool journalOk = true;
+    for(uint64_t seed = 1; seed <= 10; ++seed) {
+        journalOk = journalOk && EditorChecks::journalRecover("editor_check.journal", seed, 200);
+    }
+    std::remove("editor_check.journal");
+    std::cout << "journal recover check: " << (journalOk ? "ok" : "FAILED") << std::endl;
+}
+
+
+// Design a vending machine
+// Vending Machine must keep track of the inventory
+// A person should be able to insert cash into the machine & choose an item
+// The Machine should confirm the inserted cash with the price of the selected item
+// The machine must display an error in case of insufficient cash or unavailable item
+// Finally, if all the above steps succeed then the user gets the selected item
+
+////////////////////////////////
+// state  /////////////////////
+///////////////////////////////
+
+
+// Table-driven state machine engine. States and events are enums and the
+// transitions are a constexpr array of rows with optional guard and action
+// functions. The [state][event] -> first row index is built at compile
+// time, so dispatching an event is an array lookup plus plain function
+// pointer calls: no heap, no virtual dispatch. Rows sharing a (state, event)
+// pair are tried in table order until a guard passes.
+template<typename StateT, typename EventT, typename Context, typename Payload>
+struct Transition {
+    StateT from;
+    EventT event;
+    StateT to;
+    bool (*guard)(Context&, const Payload&);
+    void (*action)(Context&, const Payload&);
+};
+
+template<typename StateT, typename EventT, typename Context, typename Payload,
+         size_t NumStates, size_t NumEvents, size_t NumRows>
+class TransitionTable {
+    public:
+        using Row = Transition<StateT, EventT, Context, Payload>;
+    private:
+        static constexpr uint16_t none = 0xFFFF;
+        static_assert(NumRows < none, "too many transitions");
+
+        std::array<Row, NumRows> rows;
+        std::array<std::array<uint16_t, NumEvents>, NumStates> first;
+        std::array<uint16_t, NumRows> next;  // next row for the same (state, event)
+
+    public:
+        constexpr TransitionTable(const std::array<Row, NumRows>& transitions)
+            : rows(transitions), first(), next() {
+            for(size_t s = 0; s < NumStates; ++s) {
+                for(size_t e = 0; e < NumEvents; ++e) {
+                    first[s][e] = none;
+                }
+            }
+            for(size_t i = NumRows; i-- > 0;) {
+                size_t s = (size_t)rows[i].from;
+                size_t e = (size_t)rows[i].event;
+                next[i] = first[s][e];
+                first[s][e] = (uint16_t)i;
+            }
+        }
+
+        // returns false if no row accepted the event, state is then unchanged
+        bool dispatch(StateT& state, EventT event, Context& context, const Payload& payload) const {
+            for(uint16_t i = first[(size_t)state][(size_t)event]; i != none; i = next[i]) {
+                const Row& row = rows[i];
+                if(row.guard == nullptr || row.guard(context, payload)) {
+                    state = row.to;
+                    if(row.action != nullptr) {
+                        row.action(context, payload);
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+};
+
+enum class VendingState : uint8_t { NoCash, HasCash, ItemSelected, Count };
+enum class VendingEvent : uint8_t { InsertCash, ChooseItem, Dispense, Count };
+
+enum class VendingStatus : uint8_t {
+    Ok,
+    InsertCashFirst,
+    NoCashInserted,
+    CashAlreadyInserted,
+    ChooseItemFirst,
+    ItemAlreadySelected,
+    ItemUnavailable,
+    InsufficientCash,
+    EventNotAccepted
+};
+
+inline const char* statusMessage(VendingStatus status) {
+    switch(status) {
+        case VendingStatus::InsertCashFirst: return "please insert cash first";
+        case VendingStatus::NoCashInserted: return "no cash inserted, cannot dispense item";
+        case VendingStatus::CashAlreadyInserted: return "Cash already inserted, select an item";
+        case VendingStatus::ChooseItemFirst: return "No item chosen, choose an item";
+        case VendingStatus::ItemAlreadySelected: return "Item already selected";
+        case VendingStatus::ItemUnavailable: return "Item not available";
+        case VendingStatus::InsufficientCash: return "Insufficient cash";
+        case VendingStatus::EventNotAccepted: return "Not possible right now";
+        default: return "ok";
+    }
+}
+
+// The vending rules, written against any machine type that provides
+// Payload, addCash, canAfford, hasItem, reserve, selectItem, dispense and
+// setStatus.
+template<typename Machine>
+struct VendingRules {
+    using Payload = typename Machine::Payload;
+    using Table = TransitionTable<VendingState, VendingEvent, Machine, Payload,
+                                  (size_t)VendingState::Count, (size_t)VendingEvent::Count, 11>;
+
+    static void addCash(Machine& m, const Payload& p) {
+        m.addCash(p.cash);
+    }
+    static bool available(Machine& m, const Payload& p) {
+        return m.hasItem(p);
+    }
+    // stock is reserved before the state moves, so two buyers cannot both
+    // be sold the last item
+    static bool purchasable(Machine& m, const Payload& p) {
+        return m.hasItem(p) && m.canAfford(p) && m.reserve(p);
+    }
+    static void select(Machine& m, const Payload& p) {
+        m.selectItem(p);
+    }
+    static void dispense(Machine& m, const Payload&) {
+        m.dispense();
+    }
+    template<VendingStatus Status>
+    static void reject(Machine& m, const Payload&) {
+        m.setStatus(Status);
+    }
+
+    static constexpr Table table{{{
+        {VendingState::NoCash,       VendingEvent::InsertCash, VendingState::HasCash,      nullptr,      &addCash},
+        {VendingState::NoCash,       VendingEvent::ChooseItem, VendingState::NoCash,       nullptr,      &reject<VendingStatus::InsertCashFirst>},
+        {VendingState::NoCash,       VendingEvent::Dispense,   VendingState::NoCash,       nullptr,      &reject<VendingStatus::NoCashInserted>},
+        {VendingState::HasCash,      VendingEvent::InsertCash, VendingState::HasCash,      nullptr,      &addCash},
+        {VendingState::HasCash,      VendingEvent::ChooseItem, VendingState::ItemSelected, &purchasable, &select},
+        {VendingState::HasCash,      VendingEvent::ChooseItem, VendingState::HasCash,      &available,   &reject<VendingStatus::InsufficientCash>},
+        {VendingState::HasCash,      VendingEvent::ChooseItem, VendingState::HasCash,      nullptr,      &reject<VendingStatus::ItemUnavailable>},
+        {VendingState::HasCash,      VendingEvent::Dispense,   VendingState::HasCash,      nullptr,      &reject<VendingStatus::ChooseItemFirst>},
+        {VendingState::ItemSelected, VendingEvent::InsertCash, VendingState::ItemSelected, nullptr,      &reject<VendingStatus::CashAlreadyInserted>},
+        {VendingState::ItemSelected, VendingEvent::ChooseItem, VendingState::ItemSelected, nullptr,      &reject<VendingStatus::ItemAlreadySelected>},
+        {VendingState::ItemSelected, VendingEvent::Dispense,   VendingState::NoCash,       nullptr,      &dispense},
+    }}};
+};
+
+using ItemId = uint16_t;
+constexpr ItemId noItem = 0xFFFF;
+
+// Item names interned to dense ids once, when the catalog is built. Names
+// are found through a perfect hash built by hash and displace: keys are
+// grouped into buckets, and each bucket gets a seed that sends all of its
+// keys to free slots. A lookup is one string hash, one mix and one compare,
+// and never allocates. Stock is atomic so machines sharing a catalog can
+// reserve items without a lock.
+class InventoryCatalog {
+    public:
+        struct ItemSpec {
+            std::string_view name;
+            int price;
+            int stock;
+        };
+
+    private:
+        std::string names;
+        std::vector<uint32_t> nameOffsets;
+        std::vector<int> prices;
+        std::unique_ptr<std::atomic<int>[]> stock;
+        std::vector<uint32_t> seeds;
+        std::vector<ItemId> slots;
+        size_t bucketMask;
+        size_t slotMask;
+
+        static uint64_t hashName(std::string_view name) {
+            uint64_t h = 14695981039346656037ull;
+            for(char c : name) {
+                h = (h ^ (unsigned char)c) * 1099511628211ull;
+            }
+            return h;
+        }
+
+        static uint64_t mix(uint64_t h, uint64_t seed) {
+            h ^= seed * 0x9E3779B97F4A7C15ull;
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        static size_t powerOfTwo(size_t n) {
+            size_t p = 1;
+            while(p < n) {
+                p <<= 1;
+            }
+            return p;
+        }
+
+        // true if every bucket found a seed; false asks for a bigger table
+        bool place(const std::vector<uint64_t>& hashes) {
+            std::vector<std::vector<ItemId>> buckets(bucketMask + 1);
+            for(size_t i = 0; i < hashes.size(); ++i) {
+                buckets[(hashes[i] >> 32) & bucketMask].push_back((ItemId)i);
+            }
+            std::vector<size_t> order(buckets.size());
+            for(size_t b = 0; b < order.size(); ++b) {
+                order[b] = b;
+            }
+            // the fullest buckets are placed while the table is still empty
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return buckets[a].size() > buckets[b].size();
+            });
+            seeds.assign(buckets.size(), 0);
+            slots.assign(slotMask + 1, noItem);
+            std::vector<size_t> taken;
+            for(size_t b : order) {
+                if(buckets[b].empty()) {
+                    break;
+                }
+                uint32_t seed = 0;
+                for(;; ++seed) {
+                    if(seed > (1u << 16)) {
+                        return false;
+                    }
+                    taken.clear();
+                    bool fits = true;
+                    for(ItemId id : buckets[b]) {
+                        size_t slot = mix(hashes[id], seed) & slotMask;
+                        if(slots[slot] != noItem || std::find(taken.begin(), taken.end(), slot) != taken.end()) {
+                            fits = false;
+                            break;
+                        }
+                        taken.push_back(slot);
+                    }
+                    if(fits) {
+                        break;
+                    }
+                }
+                seeds[b] = seed;
+                for(size_t i = 0; i < buckets[b].size(); ++i) {
+                    slots[taken[i]] = buckets[b][i];
+                }
+            }
+            return true;
+        }
+
+    public:
+        // later duplicates of a name are ignored
+        explicit InventoryCatalog(const std::vector<ItemSpec>& items) {
+            std::vector<ItemSpec> unique;
+            std::vector<uint64_t> hashes;
+            std::unordered_set<std::string_view> seen;
+            seen.reserve(items.size());
+            for(const ItemSpec& item : items) {
+                if(unique.size() < noItem && seen.insert(item.name).second) {
+                    unique.push_back(item);
+                    hashes.push_back(hashName(item.name));
+                }
+            }
+            nameOffsets.push_back(0);
+            for(const ItemSpec& item : unique) {
+                names.append(item.name.data(), item.name.size());
+                nameOffsets.push_back((uint32_t)names.size());
+                prices.push_back(item.price);
+            }
+            stock.reset(new std::atomic<int>[unique.size()]);
+            for(size_t i = 0; i < unique.size(); ++i) {
+                stock[i].store(unique[i].stock);
+            }
+            bucketMask = powerOfTwo(unique.size() / 4 + 1) - 1;
+            slotMask = powerOfTwo(unique.size() * 2 + 1) - 1;
+            while(!place(hashes)) {
+                slotMask = slotMask * 2 + 1;
+            }
+        }
+
+        size_t size() const {
+            return prices.size();
+        }
+
+        ItemId find(std::string_view name) const {
+            uint64_t h = hashName(name);
+            ItemId id = slots[mix(h, seeds[(h >> 32) & bucketMask]) & slotMask];
+            return id != noItem && this->name(id) == name ? id : noItem;
+        }
+
+        std::string_view name(ItemId id) const {
+            return std::string_view(names.data() + nameOffsets[id], nameOffsets[id + 1] - nameOffsets[id]);
+        }
+
+        int price(ItemId id) const {
+            return prices[id];
+        }
+
+        int available(ItemId id) const {
+            return stock[id].load(std::memory_order_relaxed);
+        }
+
+        void setAvailable(ItemId id, int count) {
+            stock[id].store(count, std::memory_order_release);
+        }
+
+        // takes count items if that many are left
+        bool reserve(ItemId id, int count = 1) {
+            int left = stock[id].load(std::memory_order_relaxed);
+            while(left >= count) {
+                if(stock[id].compare_exchange_weak(left, left - count, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // hands back a reservation, or restocks
+        void release(ItemId id, int count = 1) {
+            stock[id].fetch_add(count, std::memory_order_acq_rel);
+        }
+};
+
+// Everything needed to rebuild a machine: its state machine position,
+// cash, last change and its catalog's stock levels.
+struct VendingSnapshot {
+    VendingState state;
+    int cash;
+    int lastChange;
+    ItemId selectedItem;
+    std::vector<int> stock;
+};
+
+enum class VendingRecordKind : uint8_t { InsertCash, ChooseItem, Dispense, Restock, Snapshot, StockLevel };
+
+// Fixed 16 byte log record. A Snapshot record carries absolute cash,
+// change and selection with the item count in stockDelta, and is followed
+// by one StockLevel record per item.
+struct VendingRecord {
+    VendingRecordKind kind;
+    VendingState state;  // state after the event
+    ItemId item;
+    int32_t cashDelta;
+    int32_t stockDelta;
+    int32_t change;
+};
+static_assert(sizeof(VendingRecord) == 16, "log records are written as is");
+
+// Append-only event log for one machine. Records since the last snapshot
+// are kept in memory and written to the file in batches by sync(); a
+// snapshot is taken every snapshotEvery events, and once the log has a
+// file everything before the newest snapshot is only kept there. Replay
+// streams records from the file, so memory stays one interval deep.
+class VendingEventLog {
+    private:
+        static constexpr size_t readBatch = 4096;  // records per pread
+
+        std::string path;
+        int fd;
+        size_t snapshotEvery;
+        size_t sinceSnapshot;
+        size_t written;                   // records in the file
+        size_t tailStart;                 // log index of tail[0]
+        std::vector<VendingRecord> tail;
+        std::vector<size_t> snapshots;    // log indexes of Snapshot records
+
+        // count records from log index first, false on a read error
+        bool readFile(size_t first, VendingRecord* out, size_t count) const {
+            size_t done = 0;
+            size_t bytes = count * sizeof(VendingRecord);
+            while(done < bytes) {
+                ssize_t n = ::pread(fd, (char*)out + done, bytes - done, first * sizeof(VendingRecord) + done);
+                if(n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(n <= 0) {
+                    std::perror(path.c_str());
+                    return false;
+                }
+                done += n;
+            }
+            return true;
+        }
+
+        // calls fn(record) for log indexes [from, to): the part before the
+        // tail comes from the file in batches, the rest from memory
+        template<typename Fn>
+        bool forEach(size_t from, size_t to, Fn fn) const {
+            VendingRecord batch[readBatch];
+            while(from < to && from < tailStart) {
+                size_t n = std::min({readBatch, to - from, tailStart - from});
+                if(!readFile(from, batch, n)) {
+                    return false;
+                }
+                for(size_t i = 0; i < n; ++i) {
+                    fn(batch[i]);
+                }
+                from += n;
+            }
+            for(; from < to; ++from) {
+                fn(tail[from - tailStart]);
+            }
+            return true;
+        }
+
+        void load() {
+            struct stat st;
+            if(::fstat(fd, &st) != 0) {
+                std::perror(path.c_str());
+                return;
+            }
+            // a torn last record from a crash is cut off
+            written = (size_t)st.st_size / sizeof(VendingRecord);
+            if(::ftruncate(fd, written * sizeof(VendingRecord)) != 0) {
+                std::perror(path.c_str());
+            }
+            tailStart = written;
+            size_t index = 0;
+            size_t levelsMissing = 0;     // StockLevel records the newest snapshot still needs
+            size_t beforeSnapshot = 0;    // sinceSnapshot as it was before that snapshot
+            bool ok = forEach(0, written, [&](const VendingRecord& r) {
+                if(r.kind == VendingRecordKind::Snapshot) {
+                    snapshots.push_back(index);
+                    beforeSnapshot = sinceSnapshot;
+                    sinceSnapshot = 0;
+                    levelsMissing = (size_t)std::max(0, r.stockDelta);
+                } else if(r.kind == VendingRecordKind::StockLevel) {
+                    levelsMissing -= levelsMissing > 0;
+                } else {
+                    levelsMissing = 0;
+                    sinceSnapshot++;
+                }
+                ++index;
+            });
+            if(!ok) {
+                written = tailStart = index;
+            }
+            // a crash while a snapshot was being written leaves it short of
+            // stock levels; it is cut off so the one before it is the base
+            if(ok && levelsMissing > 0) {
+                written = tailStart = snapshots.back();
+                snapshots.pop_back();
+                sinceSnapshot = beforeSnapshot;
+                if(::ftruncate(fd, written * sizeof(VendingRecord)) != 0) {
+                    std::perror(path.c_str());
+                }
+            }
+            // the newest interval goes back into memory, appends continue it
+            size_t from = snapshots.empty() ? written : snapshots.back();
+            tail.resize(written - from);
+            if(!tail.empty() && !readFile(from, tail.data(), tail.size())) {
+                tail.clear();
+                from = written;
+            }
+            tailStart = from;
+        }
+
+    public:
+        // an empty path keeps the log in memory only, all of it
+        explicit VendingEventLog(const std::string& file = "", size_t snapshotInterval = 4096)
+            : path(file), fd(-1), snapshotEvery(std::max((size_t)1, snapshotInterval)), sinceSnapshot(0),
+              written(0), tailStart(0) {
+            if(path.empty()) {
+                return;
+            }
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if(fd < 0) {
+                std::perror(path.c_str());
+                return;
+            }
+            load();
+        }
+
+        ~VendingEventLog() {
+            sync();
+            if(fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        VendingEventLog(const VendingEventLog&) = delete;
+        VendingEventLog& operator=(const VendingEventLog&) = delete;
+
+        // returns true when a snapshot is due
+        bool append(const VendingRecord& record) {
+            tail.push_back(record);
+            return ++sinceSnapshot >= snapshotEvery;
+        }
+
+        // the interval before the snapshot is written out and let go
+        void appendSnapshot(const VendingSnapshot& snap) {
+            if(fd >= 0) {
+                sync();
+                if(written == size()) {
+                    tailStart = written;
+                    tail.clear();
+                }
+            }
+            snapshots.push_back(size());
+            tail.push_back(VendingRecord{VendingRecordKind::Snapshot, snap.state, snap.selectedItem,
+                                         snap.cash, (int32_t)snap.stock.size(), snap.lastChange});
+            for(size_t i = 0; i < snap.stock.size(); ++i) {
+                tail.push_back(VendingRecord{VendingRecordKind::StockLevel, snap.state, (ItemId)i, 0, snap.stock[i], 0});
+            }
+            sinceSnapshot = 0;
+        }
+
+        void sync() {
+            if(fd < 0) {
+                return;
+            }
+            while(written < size()) {
+                const VendingRecord* from = tail.data() + (written - tailStart);
+                ssize_t n = ::write(fd, from, (size() - written) * sizeof(VendingRecord));
+                if(n < 0) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    std::perror(path.c_str());
+                    return;
+                }
+                written += n / sizeof(VendingRecord);
+            }
+        }
+
+        size_t size() const {
+            return tailStart + tail.size();
+        }
+
+        // records currently held in memory
+        size_t resident() const {
+            return tail.size();
+        }
+
+        // Rebuilds the machine as it was after the first upTo records, from
+        // the last snapshot before that point. A snapshot does not change
+        // the machine, so an upTo inside its stock levels is moved to their
+        // end. False if there is no snapshot or the file could not be read.
+        bool replay(VendingSnapshot& out, size_t upTo = SIZE_MAX) const {
+            upTo = std::min(upTo, size());
+            auto it = std::lower_bound(snapshots.begin(), snapshots.end(), upTo);
+            if(it == snapshots.begin()) {
+                return false;
+            }
+            size_t base = *(it - 1);
+            VendingRecord snapshot;
+            if(!forEach(base, base + 1, [&snapshot](const VendingRecord& r) { snapshot = r; })) {
+                return false;
+            }
+            upTo = std::max(upTo, std::min(size(), base + 1 + (size_t)std::max(0, snapshot.stockDelta)));
+            bool first = true;
+            VendingState state = VendingState::NoCash;
+            int cash = 0;
+            int change = 0;
+            ItemId selected = noItem;
+            bool ok = forEach(base, upTo, [&](const VendingRecord& r) {
+                if(first) {
+                    first = false;
+                    state = r.state;
+                    cash = r.cashDelta;
+                    change = r.change;
+                    selected = r.item;
+                    out.stock.assign(r.stockDelta, 0);
+                    return;
+                }
+                switch(r.kind) {
+                    case VendingRecordKind::StockLevel:
+                        if(r.item < out.stock.size()) {
+                            out.stock[r.item] = r.stockDelta;
+                        }
+                        break;
+                    case VendingRecordKind::Snapshot:
+                        break;  // only reached if a snapshot was torn
+                    default:
+                        state = r.state;
+                        cash += r.cashDelta;
+                        if(r.item < out.stock.size()) {
+                            out.stock[r.item] += r.stockDelta;
+                        }
+                        if(r.kind == VendingRecordKind::ChooseItem) {
+                            selected = r.item;
+                        } else if(r.kind == VendingRecordKind::Dispense) {
+                            change = r.change;
+                        }
+                }
+            });
+            if(!ok) {
+                return false;
+            }
+            out.state = state;
+            out.cash = cash;
+            out.lastChange = change;
+            out.selectedItem = selected;
+            return true;
+        }
+};
+
+class VendingMachine {
+    public:
+        struct Payload {
+            int cash;
+            ItemId item;
+        };
+    private:
+        using Rules = VendingRules<VendingMachine>;
+        friend Rules;
+
+        VendingState currentState;
+        VendingStatus status;
+        int currentCash;
+        int lastChange;
+        ItemId selectedItem;
+        InventoryCatalog& catalog;
+        VendingEventLog* log;
+
+        void addCash(int cash) {
+            currentCash += cash;
+        }
+
+        bool canAfford(const Payload& p) {
+            return getItemPrice(p) <= currentCash;
+        }
+
+        bool reserve(const Payload& p) {
+            return catalog.reserve(p.item);
+        }
+
+        void selectItem(const Payload& p) {
+            selectedItem = p.item;
+        }
+
+        // the item was reserved when it was selected
+        void dispense() {
+            int price = catalog.price(selectedItem);
+            lastChange = currentCash - price;
+            currentCash = 0;
+        }
+
+        void setStatus(VendingStatus newStatus) {
+            status = newStatus;
+        }
+
+        // rejected events change nothing and are not logged; that includes
+        // an event no row accepts
+        VendingStatus process(VendingEvent event, const Payload& payload) {
+            status = VendingStatus::Ok;
+            int cashBefore = currentCash;
+            if(!Rules::table.dispatch(currentState, event, *this, payload)) {
+                status = VendingStatus::EventNotAccepted;
+            }
+            if(log != nullptr && status == VendingStatus::Ok) {
+                bool reserved = event == VendingEvent::ChooseItem;
+                record(VendingRecord{(VendingRecordKind)event, currentState, reserved ? payload.item : noItem,
+                                     currentCash - cashBefore, reserved ? -1 : 0, lastChange});
+            }
+            return status;
+        }
+
+        void record(const VendingRecord& r) {
+            if(log->append(r)) {
+                log->appendSnapshot(snapshot());
+            }
+        }
+
+    public:
+        explicit VendingMachine(InventoryCatalog& inventory)
+            : currentState(VendingState::NoCash), status(VendingStatus::Ok), currentCash(0), lastChange(0),
+              selectedItem(noItem), catalog(inventory), log(nullptr) {}
+
+        // starts the log with a snapshot so it can be replayed on its own
+        void attachLog(VendingEventLog* eventLog) {
+            log = eventLog;
+            if(log != nullptr) {
+                log->appendSnapshot(snapshot());
+            }
+        }
+
+        VendingSnapshot snapshot() const {
+            VendingSnapshot snap{currentState, currentCash, lastChange, selectedItem, {}};
+            snap.stock.reserve(catalog.size());
+            for(size_t i = 0; i < catalog.size(); ++i) {
+                snap.stock.push_back(catalog.available((ItemId)i));
+            }
+            return snap;
+        }
+
+        void restore(const VendingSnapshot& snap) {
+            currentState = snap.state;
+            currentCash = snap.cash;
+            lastChange = snap.lastChange;
+            selectedItem = snap.selectedItem;
+            for(size_t i = 0; i < snap.stock.size() && i < catalog.size(); ++i) {
+                catalog.setAvailable((ItemId)i, snap.stock[i]);
+            }
+        }
+
+        bool restock(std::string_view item, int count) {
+            ItemId id = catalog.find(item);
+            if(id == noItem) {
+                return false;
+            }
+            catalog.release(id, count);
+            if(log != nullptr) {
+                record(VendingRecord{VendingRecordKind::Restock, currentState, id, 0, count, lastChange});
+            }
+            return true;
+        }
+
+        VendingStatus insertCash(int cash) {
+            return process(VendingEvent::InsertCash, Payload{cash, noItem});
+        }
+
+        // a successful choice dispenses straight away
+        VendingStatus chooseItem(std::string_view item) {
+            VendingStatus result = process(VendingEvent::ChooseItem, Payload{0, catalog.find(item)});
+            if(result == VendingStatus::Ok && currentState == VendingState::ItemSelected) {
+                result = dispenseItem();
+            }
+            return result;
+        }
+
+        VendingStatus dispenseItem() {
+            return process(VendingEvent::Dispense, Payload{0, noItem});
+        }
+
+        bool hasItem(const Payload& p) {
+            return p.item < catalog.size() && catalog.available(p.item) > 0;
+        }
+
+        int getItemPrice(const Payload& p) {
+            return catalog.price(p.item);
+        }
+
+        int getCurrentCash() {
+            return currentCash;
+        }
+
+        int getLastChange() {
+            return lastChange;
+        }
+
+        VendingState getState() {
+            return currentState;
+        }
+};
+
+// Checks of VendingEventLog replay against the machine it recorded. A
+// random session is logged with a short snapshot interval while the
+// machine's own snapshot is kept for every log size it passed through.
+class VendingLogChecks {
+    private:
+        struct Session {
+            std::map<size_t, VendingSnapshot> states;  // log size -> machine state
+            std::vector<size_t> snapshots;             // Snapshot records that ended an event
+        };
+
+        static uint64_t next(uint64_t& state) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        }
+
+        static bool same(const VendingSnapshot& a, const VendingSnapshot& b) {
+            return a.state == b.state && a.cash == b.cash && a.lastChange == b.lastChange &&
+                   a.selectedItem == b.selectedItem && a.stock == b.stock;
+        }
+
+        // A single-record event that triggers a snapshot adds five records,
+        // the event and then the Snapshot with three StockLevels, and the
+        // snapshot holds the state after the event. The session ends with
+        // restocks until one of them does that, so the newest snapshot in
+        // the log is always in session.snapshots.
+        static Session record(VendingEventLog& log, uint64_t seed, int steps) {
+            const char* items[] = {"Soda", "Coke", "Chips"};
+            uint64_t state = seed | 1;
+            InventoryCatalog catalog({{"Soda", 25, 20}, {"Coke", 20, 5}, {"Chips", 15, 8}});
+            VendingMachine machine(catalog);
+            Session session;
+            machine.attachLog(&log);
+            session.snapshots.push_back(0);
+            session.states[0] = session.states[log.size()] = machine.snapshot();
+            bool last = false;
+            for(int i = 0; !last; ++i) {
+                size_t before = log.size();
+                uint64_t op = i < steps ? next(state) % 5 : 4;
+                if(op < 2) {
+                    machine.insertCash(5 + (int)(next(state) % 40));
+                } else if(op < 4) {
+                    machine.chooseItem(items[next(state) % 3]);
+                } else {
+                    machine.restock(items[next(state) % 3], 1 + (int)(next(state) % 3));
+                }
+                session.states[log.size()] = machine.snapshot();
+                if(log.size() == before + 5) {
+                    session.snapshots.push_back(before + 1);
+                    session.states[before + 1] = machine.snapshot();
+                    last = i >= steps;
+                }
+            }
+            machine.attachLog(nullptr);
+            return session;
+        }
+
+    public:
+        // the file is cut inside the newest snapshot's stock levels, as a
+        // crash mid-snapshot would leave it; reopening must fall back to
+        // the snapshot before
+        static bool tornSnapshot(const std::string& path, uint64_t seed) {
+            std::remove(path.c_str());
+            Session session;
+            {
+                VendingEventLog log(path, 8);
+                session = record(log, seed, 200);
+            }
+            size_t newest = session.snapshots.back();
+            VendingSnapshot out;
+            bool ok = true;
+            {
+                VendingEventLog reopened(path);
+                ok = reopened.replay(out) && same(out, session.states.rbegin()->second);
+            }
+            ok = ok && ::truncate(path.c_str(), (newest + 2) * sizeof(VendingRecord)) == 0;
+            if(ok) {
+                VendingEventLog reopened(path);
+                ok = reopened.size() == newest && reopened.replay(out) && same(out, session.states[newest]);
+            }
+            std::remove(path.c_str());
+            return ok;
+        }
+
+        // replay up to every event boundary, every snapshot index and every
+        // point inside a snapshot's stock levels, from memory or from path
+        static bool replayPoints(const std::string& path, uint64_t seed) {
+            std::remove(path.c_str());
+            bool ok = true;
+            {
+                VendingEventLog log(path, 8);
+                Session session = record(log, seed, 200);
+                VendingSnapshot out;
+                for(const auto& [upTo, expected] : session.states) {
+                    ok = ok && (upTo == 0 || (log.replay(out, upTo) && same(out, expected)));
+                }
+                for(size_t snapshot : session.snapshots) {
+                    for(size_t inside = snapshot + 1; inside < snapshot + 4; ++inside) {
+                        ok = ok && log.replay(out, inside) && same(out, session.states[snapshot]);
+                    }
+                }
+                ok = ok && !log.replay(out, 0);
+            }
+            std::remove(path.c_str());
+            return ok;
+        }
+};
+
+// Fleet simulation: replays event logs across a large fleet of vending
+// machines. Machine state is stored struct-of-arrays and the same
+// VendingRules table drives every machine; events are sharded by machine,
+// so each shard is processed in order by one task with no locking.
+
+// Thread pool with one deque per worker. A worker pops its own deque from
+// the back and steals from the front of the others when it runs dry;
+// threads waiting in parallelFor run queued tasks instead of blocking, so
+// nested parallelism cannot deadlock.
+class WorkStealingPool {
+    private:
+        struct WorkQueue {
+            std::mutex lock;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+        std::vector<std::thread> workers;
+        std::atomic<bool> stopping;
+        std::atomic<size_t> pending;
+        std::atomic<size_t> nextQueue;
+        std::atomic<int> sleepers;
+        std::mutex sleepLock;
+        std::condition_variable wake;
+
+        static inline thread_local WorkStealingPool* currentPool = nullptr;
+        static inline thread_local size_t currentIndex = 0;
+
+        bool popFrom(size_t index, bool back, std::function<void()>& task) {
+            WorkQueue& q = *queues[index];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if(q.tasks.empty()) {
+                return false;
+            }
+            if(back) {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            } else {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            }
+            pending.fetch_sub(1);
+            return true;
+        }
+
+        bool take(std::function<void()>& task) {
+            size_t home = currentPool == this ? currentIndex : 0;
+            if(currentPool == this && popFrom(home, true, task)) {
+                return true;
+            }
+            for(size_t i = 1; i <= queues.size(); ++i) {
+                if(popFrom((home + i) % queues.size(), false, task)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void workerLoop(size_t index) {
+            currentPool = this;
+            currentIndex = index;
+            std::function<void()> task;
+            while(!stopping.load()) {
+                if(take(task)) {
+                    task();
+                    continue;
+                }
+                // same handshake as AsyncLogger: submit bumps pending before it
+                // reads sleepers, so either the predicate sees the task or
+                // submit sees this worker and notifies under the lock
+                std::unique_lock<std::mutex> lock(sleepLock);
+                sleepers.fetch_add(1);
+                wake.wait(lock, [this]() {
+                    return stopping.load() || pending.load() > 0;
+                });
+                sleepers.fetch_sub(1);
+            }
+        }
+
+    public:
+        explicit WorkStealingPool(size_t threads = std::thread::hardware_concurrency())
+            : stopping(false), pending(0), nextQueue(0), sleepers(0) {
+            threads = std::max((size_t)1, threads);
+            for(size_t i = 0; i < threads; ++i) {
+                queues.emplace_back(new WorkQueue());
+            }
+            for(size_t i = 0; i < threads; ++i) {
+                workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+            }
+        }
+
+        ~WorkStealingPool() {
+            {
+                std::lock_guard<std::mutex> guard(sleepLock);
+                stopping.store(true);
+            }
+            wake.notify_all();
+            for(auto& w : workers) {
+                w.join();
+            }
+        }
+
+        size_t size() const {
+            return workers.size();
+        }
+
+        void submit(std::function<void()> task) {
+            size_t index = currentPool == this ? currentIndex : nextQueue.fetch_add(1) % queues.size();
+            {
+                std::lock_guard<std::mutex> guard(queues[index]->lock);
+                queues[index]->tasks.push_back(std::move(task));
+            }
+            pending.fetch_add(1);
+            if(sleepers.load() > 0) {
+                std::lock_guard<std::mutex> guard(sleepLock);
+                wake.notify_one();
+            }
+        }
+
+        // runs one queued task on the calling thread, if there is one
+        bool runPending() {
+            std::function<void()> task;
+            if(!take(task)) {
+                return false;
+            }
+            task();
+            return true;
+        }
+
+        // calls fn(lo, hi) over [begin, end) in chunks of grain; the caller
+        // takes chunks too and returns once every chunk is done
+        template<typename Fn>
+        void parallelFor(size_t begin, size_t end, size_t grain, const Fn& fn) {
+            if(begin >= end) {
+                return;
+            }
+            grain = std::max((size_t)1, grain);
+            struct Shared {
+                std::atomic<size_t> next{0};
+                std::atomic<size_t> done{0};
+                size_t chunks;
+            };
+            std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+            shared->chunks = (end - begin + grain - 1) / grain;
+            const Fn* body = &fn;
+            // helpers may start after the loop is over; they then find no
+            // chunk left and never touch body
+            auto run = [shared, body, begin, end, grain]() {
+                size_t c;
+                while((c = shared->next.fetch_add(1)) < shared->chunks) {
+                    size_t lo = begin + c * grain;
+                    (*body)(lo, std::min(end, lo + grain));
+                    shared->done.fetch_add(1);
+                }
+            };
+            size_t helpers = std::min(size(), shared->chunks) - 1;
+            for(size_t i = 0; i < helpers; ++i) {
+                submit(run);
+            }
+            run();
+            while(shared->done.load() < shared->chunks) {
+                if(!runPending()) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+};
+
+struct FleetEvent {
+    uint32_t machine;
+    VendingEvent type;
+    uint16_t item;
+    int32_t cash;
+};
+
+struct FleetReport {
+    size_t events;
+    size_t dropped;    // out of range for this fleet, never replayed
+    size_t rejected;
+    size_t threads;
+    double seconds;
+    double eventsPerSec;
+    double scalingEfficiency;  // speedup over one thread divided by threads
+    long long revenue;
+    long long cashInMachines;
+    long long stockLeft;
+};
+
+class VendingFleet {
+    private:
+        size_t machineCount;
+        size_t itemCount;
+        std::vector<int> prices;
+        std::vector<VendingState> states;
+        std::vector<int> cash;
+        std::vector<uint16_t> selected;
+        std::vector<long long> revenue;
+        std::vector<int> stock;  // machine * itemCount + item
+
+        // the VendingRules machine interface over one column slot
+        struct Machine {
+            using Payload = struct {
+                int cash;
+                uint16_t item;
+            };
+            VendingFleet* fleet;
+            size_t id;
+            VendingStatus status;
+
+            void addCash(int amount) {
+                fleet->cash[id] += amount;
+            }
+            bool hasItem(const Payload& p) {
+                return p.item < fleet->itemCount && fleet->stock[id * fleet->itemCount + p.item] > 0;
+            }
+            bool canAfford(const Payload& p) {
+                return fleet->prices[p.item] <= fleet->cash[id];
+            }
+            bool reserve(const Payload& p) {
+                fleet->stock[id * fleet->itemCount + p.item]--;
+                return true;
+            }
+            void selectItem(const Payload& p) {
+                fleet->selected[id] = p.item;
+            }
+            void dispense() {
+                uint16_t item = fleet->selected[id];
+                fleet->revenue[id] += fleet->prices[item];
+                fleet->cash[id] = 0;  // change goes back to the customer
+            }
+            void setStatus(VendingStatus s) {
+                status = s;
+            }
+        };
+        using Rules = VendingRules<Machine>;
+
+        // one shard's events in log order; returns how many were rejected
+        size_t replay(const FleetEvent* events, size_t count) {
+            size_t rejected = 0;
+            for(size_t i = 0; i < count; ++i) {
+                const FleetEvent& e = events[i];
+                Machine m{this, e.machine, VendingStatus::Ok};
+                bool matched = Rules::table.dispatch(states[e.machine], e.type, m, Machine::Payload{e.cash, e.item});
+                rejected += !matched || m.status != VendingStatus::Ok;
+            }
+            return rejected;
+        }
+
+    public:
+        VendingFleet(size_t machines, const std::vector<int>& itemPrices, int initialStock)
+            : machineCount(machines), itemCount(itemPrices.size()), prices(itemPrices),
+              states(machines, VendingState::NoCash), cash(machines, 0), selected(machines, 0),
+              revenue(machines, 0), stock(machines * itemPrices.size(), initialStock) {}
+
+        size_t size() const {
+            return machineCount;
+        }
+
+        // machine, event type and item all index the fleet's columns
+        bool accepts(const FleetEvent& e) const {
+            return e.machine < machineCount && e.type < VendingEvent::Count && e.item < itemCount;
+        }
+
+        // Lines of "machine event item cash", event 0 = insert cash,
+        // 1 = choose item, 2 = dispense. Lines that don't fit the field
+        // types are skipped and counted in dropped; simulate() checks the
+        // ranges against the fleet itself.
+        static std::vector<FleetEvent> loadEvents(std::istream& in, size_t* dropped = nullptr) {
+            std::vector<FleetEvent> events;
+            size_t skipped = 0;
+            long long machine, type, item, amount;
+            while(in >> machine >> type >> item >> amount) {
+                if(machine < 0 || machine > UINT32_MAX || type < 0 || type >= (long long)VendingEvent::Count ||
+                   item < 0 || item > UINT16_MAX || amount < INT32_MIN || amount > INT32_MAX) {
+                    ++skipped;
+                    continue;
+                }
+                events.push_back(FleetEvent{(uint32_t)machine, (VendingEvent)type, (uint16_t)item, (int32_t)amount});
+            }
+            if(dropped != nullptr) {
+                *dropped = skipped;
+            }
+            return events;
+        }
+
+        // Replays a log on the pool. Events are bucketed by shard first
+        // (keeping log order within a machine), then shards are dealt out
+        // as tasks and stolen by idle workers.
+        FleetReport simulate(const std::vector<FleetEvent>& events, WorkStealingPool& pool, size_t shards = 0) {
+            if(shards == 0) {
+                shards = pool.size() * 16;
+            }
+            shards = std::max((size_t)1, std::min(shards, machineCount));
+            size_t perShard = (machineCount + shards - 1) / shards;
+            std::vector<size_t> offsets(shards + 1, 0);
+            size_t dropped = 0;
+            for(const FleetEvent& e : events) {
+                if(!accepts(e)) {
+                    ++dropped;
+                    continue;
+                }
+                offsets[e.machine / perShard + 1]++;
+            }
+            for(size_t s = 0; s < shards; ++s) {
+                offsets[s + 1] += offsets[s];
+            }
+            std::vector<FleetEvent> sharded(events.size() - dropped);
+            std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+            for(const FleetEvent& e : events) {
+                if(accepts(e)) {
+                    sharded[fill[e.machine / perShard]++] = e;
+                }
+            }
+
+            std::vector<size_t> rejected(shards, 0);
+            auto start = std::chrono::steady_clock::now();
+            pool.parallelFor(0, shards, 1, [&](size_t lo, size_t hi) {
+                for(size_t s = lo; s < hi; ++s) {
+                    rejected[s] = replay(sharded.data() + offsets[s], offsets[s + 1] - offsets[s]);
+                }
+            });
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            FleetReport report{};
+            report.events = events.size();
+            report.dropped = dropped;
+            report.threads = pool.size();
+            report.seconds = seconds;
+            report.eventsPerSec = seconds > 0 ? sharded.size() / seconds : 0;
+            report.scalingEfficiency = 1.0;
+            for(size_t r : rejected) {
+                report.rejected += r;
+            }
+            for(size_t m = 0; m < machineCount; ++m) {
+                report.revenue += revenue[m];
+                report.cashInMachines += cash[m];
+            }
+            for(int left : stock) {
+                report.stockLeft += left;
+            }
+            return report;
+        }
+
+        // replays the same log on fresh fleets with 1, 2, 4 ... maxThreads
+        // threads and fills in each run's efficiency against one thread
+        static std::vector<FleetReport> scaling(size_t machines, const std::vector<int>& itemPrices, int initialStock,
+                                                const std::vector<FleetEvent>& events, size_t maxThreads) {
+            std::vector<FleetReport> reports;
+            for(size_t threads = 1; threads <= std::max((size_t)1, maxThreads); threads *= 2) {
+                VendingFleet fleet(machines, itemPrices, initialStock);
+                WorkStealingPool pool(threads);
+                FleetReport r = fleet.simulate(events, pool);
+                r.scalingEfficiency = reports.empty() ? 1.0 : r.eventsPerSec / reports[0].eventsPerSec / threads;
+                reports.push_back(r);
+            }
+            return reports;
+        }
+};
+
+int main() {
+    InventoryCatalog catalog({{"Soda", 25, 20}, {"Coke", 20, 5}});
+    VendingMachine machine(catalog);
+    std::cout<<statusMessage(machine.chooseItem("Soda"))<<"\n";
+    std::cout<<statusMessage(machine.insertCash(50))<<"\n";
+    std::cout<<statusMessage(machine.chooseItem("Soda"))<<", change "<<machine.getLastChange()<<"\n";
+    std::cout<<statusMessage(machine.insertCash(20))<<"\n";
+    std::cout<<statusMessage(machine.chooseItem("Soda"))<<"\n";
+
+    // audit: replay the log into a second machine
+    VendingEventLog log("vending.log", 1024);
+    machine.attachLog(&log);
+    machine.restock("Coke", 10);
+    for(int i = 0; i < 10; ++i) {
+        machine.insertCash(30);
+        machine.chooseItem(i % 2 ? "Soda" : "Coke");
+    }
+    log.sync();
+
+    InventoryCatalog auditCatalog({{"Soda", 25, 0}, {"Coke", 20, 0}});
+    VendingMachine audited(auditCatalog);
+    VendingSnapshot snap;
+    if(log.replay(snap)) {
+        audited.restore(snap);
+        std::cout<<"replayed "<<log.size()<<" records: cash "<<audited.getCurrentCash()<<", change "<<audited.getLastChange()
+                 <<", Soda "<<auditCatalog.available(auditCatalog.find("Soda"))<<", Coke "<<auditCatalog.available(auditCatalog.find("Coke"))<<"\n";
+    }
+    std::cout<<"torn snapshot check: "<<(VendingLogChecks::tornSnapshot("vending_check.log", 1) ? "ok" : "FAILED")<<"\n";
+    bool replayOk = VendingLogChecks::replayPoints("", 2) && VendingLogChecks::replayPoints("vending_check.log", 3);
+    std::cout<<"replay check: "<<(replayOk ? "ok" : "FAILED")<<"\n";
+
+    // the same rules over a whole fleet, sharded across the pool
+    const size_t machines = 100000;
+    std::vector<int> prices = {25, 20, 15, 30, 10, 40, 35, 5};
+
+    // synthetic log: each customer inserts cash, picks an item, takes it
+    std::vector<FleetEvent> events;
+    uint64_t state = 88172645463325252ull;
+    for(size_t i = 0; i < 2000000; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint32_t machine = (uint32_t)(state % machines);
+        uint16_t item = (uint16_t)((state >> 32) % prices.size());
+        events.push_back(FleetEvent{machine, VendingEvent::InsertCash, 0, (int32_t)(10 + (state >> 40) % 40)});
+        events.push_back(FleetEvent{machine, VendingEvent::ChooseItem, item, 0});
+        events.push_back(FleetEvent{machine, VendingEvent::Dispense, 0, 0});
+    }
+
+    for(const FleetReport& r : VendingFleet::scaling(machines, prices, 10, events, std::thread::hardware_concurrency())) {
+        std::cout << r.threads << " threads: " << std::fixed << std::setprecision(0) << r.eventsPerSec << " events/s, efficiency "
+                  << std::setprecision(2) << r.scalingEfficiency << ", dropped " << r.dropped << ", rejected " << r.rejected
+                  << ", revenue " << r.revenue << ", cash held " << r.cashInMachines << ", stock left " << r.stockLeft << "\n";
+    }
+}
+
+// Design Unix File Search API to search file with different 
+// arguments as "extension", "name", "size" ... using filter design pattern 
+
+////////////////////////////////
+// Criteria   /////////////////
+///////////////////////////////
+
+class File {
+private:
+    std::string name;
+    std::string extension;
+    int size; // Size in KB
+
+public:
+    File(const std::string& name, const std::string& extension, int size)
+        : name(name), extension(extension), size(size) {}
+
+    const std::string& getName() const { return name; }
+    const std::string& getExtension() const { return extension; }
+    int getSize() const { return size; }
+};
+
+// Columnar catalog: sizes live in one int array and names and extensions
+// are dictionary encoded, so a predicate becomes a scan over an int column
+// that writes one bit per row.
+
+// Sorted, de-duplicated strings stored as offsets into one byte buffer. A
+// string's code is its position in sorted order, so code order is string
+// order and lookup is a binary search.
+struct StringPoolView {
+    size_t count;
+    const uint32_t* offsets;  // count + 1 entries
+    const char* bytes;
+
+    std::string_view at(int32_t code) const {
+        return std::string_view(bytes + offsets[code], offsets[code + 1] - offsets[code]);
+    }
+
+    // -1 if the string is not in the pool
+    int32_t codeOf(std::string_view s) const {
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (at((int32_t)mid) < s) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo < count && at((int32_t)lo) == s ? (int32_t)lo : -1;
+    }
+};
+
+class StringPool {
+private:
+    std::vector<uint32_t> offsets;
+    std::string bytes;
+
+public:
+    StringPool() : offsets(1, 0) {}
+
+    explicit StringPool(std::vector<std::string_view> strings) : offsets(1, 0) {
+        std::sort(strings.begin(), strings.end());
+        strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+        for (std::string_view s : strings) {
+            bytes.append(s.data(), s.size());
+            offsets.push_back((uint32_t)bytes.size());
+        }
+    }
+
+    StringPoolView view() const {
+        return StringPoolView{offsets.size() - 1, offsets.data(), bytes.data()};
+    }
+};
+
+class SelectionBitmap {
+private:
+    std::vector<uint64_t> words;
+    size_t rows;
+
+    void clearTail() {
+        if (rows % 64 != 0) {
+            words.back() &= ~0ull >> (64 - rows % 64);
+        }
+    }
+
+public:
+    explicit SelectionBitmap(size_t rows = 0, bool value = false) : rows(0) { reset(rows, value); }
+
+    void reset(size_t rowCount, bool value = false) {
+        rows = rowCount;
+        words.assign((rows + 63) / 64, value ? ~0ull : 0);
+        if (value) {
+            clearTail();
+        }
+    }
+
+    size_t size() const { return rows; }
+    uint64_t* data() { return words.data(); }
+    const uint64_t* data() const { return words.data(); }
+
+    bool test(size_t row) const { return (words[row / 64] >> (row % 64)) & 1; }
+    void set(size_t row) { words[row / 64] |= 1ull << (row % 64); }
+
+    size_t count() const {
+        size_t n = 0;
+        for (uint64_t w : words) {
+            n += __builtin_popcountll(w);
+        }
+        return n;
+    }
+
+    SelectionBitmap& operator&=(const SelectionBitmap& other) {
+        for (size_t i = 0; i < words.size(); ++i) {
+            words[i] &= other.words[i];
+        }
+        return *this;
+    }
+
+    SelectionBitmap& operator|=(const SelectionBitmap& other) {
+        for (size_t i = 0; i < words.size(); ++i) {
+            words[i] |= other.words[i];
+        }
+        return *this;
+    }
+
+    void flip() {
+        for (uint64_t& w : words) {
+            w = ~w;
+        }
+        if (!words.empty()) {
+            clearTail();
+        }
+    }
+
+    // calls fn(row) for every set row in order
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        for (size_t i = 0; i < words.size(); ++i) {
+            for (uint64_t w = words[i]; w != 0; w &= w - 1) {
+                fn(i * 64 + __builtin_ctzll(w));
+            }
+        }
+    }
+};
+
+struct ColumnScan {
+    // Sets bit i of out when lo <= column[i] <= hi; out needs a word for
+    // every 64 rows. With AVX2 each word is built from eight 8-lane
+    // compares; the scalar loop is written branch free so it vectorizes too.
+    static void between(const int32_t* column, size_t rows, int32_t lo, int32_t hi, uint64_t* out) {
+        size_t i = 0;
+#ifdef __AVX2__
+        __m256i low = _mm256_set1_epi32(lo);
+        __m256i high = _mm256_set1_epi32(hi);
+        for (; i + 64 <= rows; i += 64) {
+            uint64_t bits = 0;
+            for (int k = 0; k < 8; ++k) {
+                __m256i v = _mm256_loadu_si256((const __m256i*)(column + i + 8 * k));
+                __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(low, v), _mm256_cmpgt_epi32(v, high));
+                uint64_t lanes = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(outside));
+                bits |= (~lanes & 0xFF) << (8 * k);
+            }
+            out[i / 64] = bits;
+        }
+#endif
+        for (; i < rows; i += 64) {
+            size_t n = std::min((size_t)64, rows - i);
+            uint64_t bits = 0;
+            for (size_t k = 0; k < n; ++k) {
+                bits |= (uint64_t)((column[i + k] >= lo) & (column[i + k] <= hi)) << k;
+            }
+            out[i / 64] = bits;
+        }
+    }
+};
+
+// Plain pointers to the columns, so a catalog built in memory and one
+// mapped from disk are scanned the same way.
+struct FileCatalogView {
+    size_t rows;
+    const int32_t* sizes;
+    const int32_t* nameCodes;
+    const int32_t* extensionCodes;
+    StringPoolView names;
+    StringPoolView extensions;
+};
+
+// On-disk catalog: a header and section table followed by the columns,
+// the two string pools and the rows ordered by size, each section 64 byte
+// aligned so it can be scanned in place. Opening checks everything a query
+// could index with: section bounds, the row count, the string pool offsets
+// and the range of every code column, so any catalog that opens is safe to
+// query. verify() adds the section checksums, which costs a full read and
+// is left to the caller.
+struct CatalogFormat {
+    enum Section : uint32_t { Sizes, NameCodes, ExtensionCodes, NameOffsets, NameBytes,
+                              ExtensionOffsets, ExtensionBytes, SizeOrder, SectionCount };
+
+    struct SectionEntry {
+        uint32_t id;
+        uint32_t crc;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint64_t rows;
+        uint32_t sectionCount;
+        uint32_t tableCrc;  // over the section table
+        SectionEntry sections[SectionCount];
+    };
+
+    static constexpr uint32_t currentVersion = 1;
+    static constexpr size_t alignment = 64;
+};
+
+class FileCatalog {
+private:
+    StringPool names;
+    StringPool extensions;
+    std::vector<int32_t> sizes;
+    std::vector<int32_t> nameCodes;
+    std::vector<int32_t> extensionCodes;
+
+public:
+    FileCatalog() {}
+
+    explicit FileCatalog(const std::vector<File>& files) {
+        std::vector<std::string_view> allNames, allExtensions;
+        for (const auto& file : files) {
+            allNames.push_back(file.getName());
+            allExtensions.push_back(file.getExtension());
+        }
+        names = StringPool(allNames);
+        extensions = StringPool(allExtensions);
+        StringPoolView nameView = names.view(), extensionView = extensions.view();
+        sizes.reserve(files.size());
+        nameCodes.reserve(files.size());
+        extensionCodes.reserve(files.size());
+        for (const auto& file : files) {
+            sizes.push_back(file.getSize());
+            nameCodes.push_back(nameView.codeOf(file.getName()));
+            extensionCodes.push_back(extensionView.codeOf(file.getExtension()));
+        }
+    }
+
+    size_t size() const { return sizes.size(); }
+
+    FileCatalogView view() const {
+        return FileCatalogView{sizes.size(), sizes.data(), nameCodes.data(), extensionCodes.data(),
+                               names.view(), extensions.view()};
+    }
+
+    File file(size_t row) const {
+        FileCatalogView v = view();
+        return File(std::string(v.names.at(nameCodes[row])), std::string(v.extensions.at(extensionCodes[row])), sizes[row]);
+    }
+
+    std::vector<File> materialize(const SelectionBitmap& selection) const {
+        std::vector<File> files;
+        files.reserve(selection.count());
+        selection.forEach([&](size_t row) { files.push_back(file(row)); });
+        return files;
+    }
+
+    // writes the catalog file format read by MappedFileCatalog
+    bool save(const std::string& path) const {
+        FileCatalogView v = view();
+        std::vector<uint32_t> sizeOrder(v.rows);
+        for (size_t i = 0; i < v.rows; ++i) {
+            sizeOrder[i] = (uint32_t)i;
+        }
+        std::stable_sort(sizeOrder.begin(), sizeOrder.end(), [&](uint32_t a, uint32_t b) { return v.sizes[a] < v.sizes[b]; });
+
+        struct Part {
+            const void* data;
+            size_t length;
+        };
+        Part parts[CatalogFormat::SectionCount] = {
+            {v.sizes, v.rows * 4},
+            {v.nameCodes, v.rows * 4},
+            {v.extensionCodes, v.rows * 4},
+            {v.names.offsets, (v.names.count + 1) * 4},
+            {v.names.bytes, v.names.offsets[v.names.count]},
+            {v.extensions.offsets, (v.extensions.count + 1) * 4},
+            {v.extensions.bytes, v.extensions.offsets[v.extensions.count]},
+            {sizeOrder.data(), v.rows * 4},
+        };
+        CatalogFormat::Header header{};
+        std::memcpy(header.magic, "FCAT", 4);
+        header.version = CatalogFormat::currentVersion;
+        header.rows = v.rows;
+        header.sectionCount = CatalogFormat::SectionCount;
+        uint64_t offset = sizeof(header);
+        for (uint32_t i = 0; i < CatalogFormat::SectionCount; ++i) {
+            offset = (offset + CatalogFormat::alignment - 1) / CatalogFormat::alignment * CatalogFormat::alignment;
+            header.sections[i] = {i, Crc32::compute(parts[i].data, parts[i].length), offset, parts[i].length};
+            offset += parts[i].length;
+        }
+        header.tableCrc = Crc32::compute(header.sections, sizeof(header.sections));
+
+        // written beside the target and renamed over it, so readers never see
+        // a half-written catalog
+        std::string temp = path + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::perror(temp.c_str());
+            return false;
+        }
+        auto writeAt = [&](const void* data, size_t length, uint64_t at) {
+            const char* p = (const char*)data;
+            while (length > 0) {
+                ssize_t n = ::pwrite(fd, p, length, at);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                p += n;
+                at += n;
+                length -= n;
+            }
+            return true;
+        };
+        bool ok = writeAt(&header, sizeof(header), 0) && ::ftruncate(fd, offset) == 0;
+        for (uint32_t i = 0; ok && i < CatalogFormat::SectionCount; ++i) {
+            ok = writeAt(parts[i].data, parts[i].length, header.sections[i].offset);
+        }
+        ok = ok && ::fsync(fd) == 0;
+        if (!ok) {
+            std::perror(temp.c_str());
+        }
+        ::close(fd);
+        if (ok && ::rename(temp.c_str(), path.c_str()) != 0) {
+            std::perror(path.c_str());
+            ok = false;
+        }
+        if (!ok) {
+            ::unlink(temp.c_str());
+            return false;
+        }
+        // the rename itself only survives a crash once the directory is synced
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd < 0 || ::fsync(dirFd) != 0) {
+            std::perror(dir.c_str());
+            ok = false;
+        }
+        if (dirFd >= 0) {
+            ::close(dirFd);
+        }
+        return ok;
+    }
+};
+
+class MappedFileCatalog {
+private:
+    std::string path;
+    int fd;
+    const char* base;
+    size_t mappedSize;
+    const CatalogFormat::Header* header;
+
+    template<typename T>
+    const T* section(CatalogFormat::Section id) const {
+        return (const T*)(base + header->sections[id].offset);
+    }
+
+    bool fail(const char* reason) {
+        std::cerr << path << ": " << reason << "\n";
+        return false;
+    }
+
+    bool open() {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::perror(path.c_str());
+            return false;
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            std::perror(path.c_str());
+            return false;
+        }
+        if ((size_t)st.st_size < sizeof(CatalogFormat::Header)) {
+            return fail("too small to be a file catalog");
+        }
+        void* p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            std::perror(path.c_str());
+            return false;
+        }
+        base = (const char*)p;
+        mappedSize = st.st_size;
+        const CatalogFormat::Header* h = (const CatalogFormat::Header*)base;
+        if (std::memcmp(h->magic, "FCAT", 4) != 0) {
+            return fail("not a file catalog");
+        }
+        if (h->version != CatalogFormat::currentVersion || h->sectionCount != CatalogFormat::SectionCount) {
+            return fail("unsupported catalog version");
+        }
+        if (Crc32::compute(h->sections, sizeof(h->sections)) != h->tableCrc) {
+            return fail("section table checksum mismatch");
+        }
+        for (const CatalogFormat::SectionEntry& entry : h->sections) {
+            if (entry.offset % 4 != 0 || entry.offset > mappedSize || entry.length > mappedSize - entry.offset) {
+                return fail("section out of bounds");
+            }
+        }
+        // bounded by the file before multiplying, so rows * 4 cannot wrap
+        if (h->rows > mappedSize / 4) {
+            return fail("row count larger than the file");
+        }
+        uint64_t columnBytes = h->rows * 4;
+        const CatalogFormat::SectionEntry* s = h->sections;
+        if (s[CatalogFormat::Sizes].length != columnBytes || s[CatalogFormat::NameCodes].length != columnBytes ||
+            s[CatalogFormat::ExtensionCodes].length != columnBytes || s[CatalogFormat::SizeOrder].length != columnBytes ||
+            s[CatalogFormat::NameOffsets].length < 4 || s[CatalogFormat::NameOffsets].length % 4 != 0 ||
+            s[CatalogFormat::ExtensionOffsets].length < 4 || s[CatalogFormat::ExtensionOffsets].length % 4 != 0) {
+            return fail("column lengths do not match the row count");
+        }
+        header = h;
+        FileCatalogView v = view();
+        if (!poolValid(v.names, s[CatalogFormat::NameBytes].length) ||
+            !poolValid(v.extensions, s[CatalogFormat::ExtensionBytes].length)) {
+            header = nullptr;
+            return fail("string pool offsets out of bounds");
+        }
+        if (!below((const uint32_t*)v.nameCodes, v.rows, v.names.count) ||
+            !below((const uint32_t*)v.extensionCodes, v.rows, v.extensions.count) ||
+            !below(section<uint32_t>(CatalogFormat::SizeOrder), v.rows, v.rows)) {
+            header = nullptr;
+            return fail("codes out of range");
+        }
+        return true;
+    }
+
+    // every value < limit; negative codes read as unsigned fail too
+    static bool below(const uint32_t* values, size_t count, size_t limit) {
+        uint32_t highest = 0;
+        for (size_t i = 0; i < count; ++i) {
+            highest = std::max(highest, values[i]);
+        }
+        return count == 0 || highest < limit;
+    }
+
+    static bool poolValid(const StringPoolView& pool, uint64_t bytes) {
+        for (size_t i = 0; i < pool.count; ++i) {
+            if (pool.offsets[i] > pool.offsets[i + 1]) {
+                return false;
+            }
+        }
+        return pool.offsets[0] == 0 && pool.offsets[pool.count] == bytes;
+    }
+
+public:
+    explicit MappedFileCatalog(const std::string& path)
+        : path(path), fd(-1), base(nullptr), mappedSize(0), header(nullptr) {
+        if (!open()) {
+            header = nullptr;
+        }
+    }
+
+    ~MappedFileCatalog() {
+        if (base != nullptr) {
+            ::munmap((void*)base, mappedSize);
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    MappedFileCatalog(const MappedFileCatalog&) = delete;
+    MappedFileCatalog& operator=(const MappedFileCatalog&) = delete;
+
+    bool isOpen() const { return header != nullptr; }
+    size_t size() const { return isOpen() ? header->rows : 0; }
+
+    // an empty view if the file did not open
+    FileCatalogView view() const {
+        static const uint32_t emptyOffsets[1] = {0};
+        if (!isOpen()) {
+            return FileCatalogView{0, nullptr, nullptr, nullptr, {0, emptyOffsets, ""}, {0, emptyOffsets, ""}};
+        }
+        const CatalogFormat::SectionEntry* s = header->sections;
+        return FileCatalogView{
+            header->rows,
+            section<int32_t>(CatalogFormat::Sizes),
+            section<int32_t>(CatalogFormat::NameCodes),
+            section<int32_t>(CatalogFormat::ExtensionCodes),
+            {s[CatalogFormat::NameOffsets].length / 4 - 1, section<uint32_t>(CatalogFormat::NameOffsets), section<char>(CatalogFormat::NameBytes)},
+            {s[CatalogFormat::ExtensionOffsets].length / 4 - 1, section<uint32_t>(CatalogFormat::ExtensionOffsets),
+             section<char>(CatalogFormat::ExtensionBytes)},
+        };
+    }
+
+    // rows with minSize <= size <= maxSize, ascending, from the size order
+    void rowsBySize(int minSize, int maxSize, std::vector<uint32_t>& out) const {
+        out.clear();
+        if (!isOpen() || minSize > maxSize) {
+            return;
+        }
+        const uint32_t* order = section<uint32_t>(CatalogFormat::SizeOrder);
+        const int32_t* sizes = section<int32_t>(CatalogFormat::Sizes);
+        const uint32_t* end = order + header->rows;
+        const uint32_t* first = std::partition_point(order, end, [&](uint32_t row) { return sizes[row] < minSize; });
+        const uint32_t* last = std::partition_point(first, end, [&](uint32_t row) { return sizes[row] <= maxSize; });
+        out.assign(first, last);
+        std::sort(out.begin(), out.end());
+    }
+
+    File file(size_t row) const {
+        FileCatalogView v = view();
+        return File(std::string(v.names.at(v.nameCodes[row])), std::string(v.extensions.at(v.extensionCodes[row])), v.sizes[row]);
+    }
+
+    // Checksums every section, reading the whole file. A catalog that
+    // fails this is still safe to query, but its contents may be wrong.
+    bool verify() const {
+        if (!isOpen()) {
+            return false;
+        }
+        for (const CatalogFormat::SectionEntry& entry : header->sections) {
+            if (Crc32::compute(base + entry.offset, entry.length) != entry.crc) {
+                std::cerr << path << ": section " << entry.id << " checksum mismatch\n";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Secondary indexes over a file list: hash lookups by extension and name,
+// and the rows sorted by size for range queries. Row lists are ascending.
+class FileIndex {
+private:
+    size_t rows;
+    std::unordered_map<std::string, std::vector<uint32_t>> byExtension;
+    std::unordered_map<std::string, std::vector<uint32_t>> byName;
+    std::vector<int32_t> sortedSizes;
+    std::vector<uint32_t> sizeRows;
+    static inline const std::vector<uint32_t> noRows;
+
+    static const std::vector<uint32_t>& find(const std::unordered_map<std::string, std::vector<uint32_t>>& index,
+                                             const std::string& key) {
+        auto it = index.find(key);
+        return it == index.end() ? noRows : it->second;
+    }
+
+public:
+    explicit FileIndex(const std::vector<File>& files) : rows(files.size()) {
+        for (size_t i = 0; i < files.size(); ++i) {
+            byExtension[files[i].getExtension()].push_back((uint32_t)i);
+            byName[files[i].getName()].push_back((uint32_t)i);
+        }
+        // (size, row) packed into one key, the sign bit flipped so negative
+        // sizes order first
+        std::vector<uint64_t> keys(files.size());
+        for (size_t i = 0; i < files.size(); ++i) {
+            keys[i] = (uint64_t)((uint32_t)files[i].getSize() ^ 0x80000000u) << 32 | i;
+        }
+        std::sort(keys.begin(), keys.end());
+        sortedSizes.reserve(files.size());
+        sizeRows.reserve(files.size());
+        for (uint64_t key : keys) {
+            sortedSizes.push_back((int32_t)((uint32_t)(key >> 32) ^ 0x80000000u));
+            sizeRows.push_back((uint32_t)key);
+        }
+    }
+
+    size_t size() const { return rows; }
+
+    const std::vector<uint32_t>& withExtension(const std::string& extension) const { return find(byExtension, extension); }
+    const std::vector<uint32_t>& withName(const std::string& name) const { return find(byName, name); }
+
+    // number of files with minSize <= size <= maxSize
+    size_t countSizes(int minSize, int maxSize) const {
+        if (minSize > maxSize) {
+            return 0;
+        }
+        return std::upper_bound(sortedSizes.begin(), sortedSizes.end(), maxSize) -
+               std::lower_bound(sortedSizes.begin(), sortedSizes.end(), minSize);
+    }
+
+    void sizeRange(int minSize, int maxSize, std::vector<uint32_t>& out) const {
+        out.clear();
+        if (minSize > maxSize) {
+            return;
+        }
+        size_t first = std::lower_bound(sortedSizes.begin(), sortedSizes.end(), minSize) - sortedSizes.begin();
+        size_t last = std::upper_bound(sortedSizes.begin(), sortedSizes.end(), maxSize) - sortedSizes.begin();
+        out.assign(sizeRows.begin() + first, sizeRows.begin() + last);
+        std::sort(out.begin(), out.end());
+    }
+};
+
+class Filter {
+public:
+    virtual ~Filter() {}
+    virtual bool matches(const File& file) const = 0;
+
+    // Estimated fraction of files that pass, exact when an index covers
+    // the filter. The planner runs the most selective conjunct first.
+    virtual double selectivity(const FileIndex*) const { return 0.5; }
+
+    // fills rows, ascending, from an index; false if no index applies
+    virtual bool lookup(const FileIndex&, std::vector<uint32_t>&) const { return false; }
+
+    // the filters that must all pass; And flattens into its children
+    virtual void conjuncts(std::vector<const Filter*>& out) const { out.push_back(this); }
+
+    // one pass, composite filters short-circuit per file
+    virtual std::vector<File> meetCriteria(const std::vector<File>& files) const {
+        std::vector<File> filteredFiles;
+        for (const auto& file : files) {
+            if (matches(file)) {
+                filteredFiles.push_back(file);
+            }
+        }
+        return filteredFiles;
+    }
+
+    // keeps only the indexes in rows whose file passes, in order
+    virtual void refine(const std::vector<File>& files, std::vector<uint32_t>& rows) const {
+        size_t kept = 0;
+        for (uint32_t row : rows) {
+            rows[kept] = row;
+            kept += matches(files[row]);
+        }
+        rows.resize(kept);
+    }
+
+    // overwrites out with one bit per catalog row, set where the row passes
+    virtual void select(const FileCatalogView& view, SelectionBitmap& out) const = 0;
+};
+
+class ExtensionFilter : public Filter {
+private:
+    std::string extension;
+
+public:
+    ExtensionFilter(const std::string& extension) : extension(extension) {}
+
+    bool matches(const File& file) const override {
+        return file.getExtension() == extension;
+    }
+
+    double selectivity(const FileIndex* index) const override {
+        return index != nullptr && index->size() > 0 ? (double)index->withExtension(extension).size() / index->size() : 0.1;
+    }
+
+    bool lookup(const FileIndex& index, std::vector<uint32_t>& rows) const override {
+        rows = index.withExtension(extension);
+        return true;
+    }
+
+    void select(const FileCatalogView& view, SelectionBitmap& out) const override {
+        out.reset(view.rows);
+        int32_t code = view.extensions.codeOf(extension);
+        if (code >= 0) {
+            ColumnScan::between(view.extensionCodes, view.rows, code, code, out.data());
+        }
+    }
+};
+
+class NameFilter : public Filter {
+private:
+    std::string name;
+
+public:
+    NameFilter(const std::string& name) : name(name) {}
+
+    bool matches(const File& file) const override {
+        return file.getName() == name;
+    }
+
+    double selectivity(const FileIndex* index) const override {
+        return index != nullptr && index->size() > 0 ? (double)index->withName(name).size() / index->size() : 0.001;
+    }
+
+    bool lookup(const FileIndex& index, std::vector<uint32_t>& rows) const override {
+        rows = index.withName(name);
+        return true;
+    }
+
+    void select(const FileCatalogView& view, SelectionBitmap& out) const override {
+        out.reset(view.rows);
+        int32_t code = view.names.codeOf(name);
+        if (code >= 0) {
+            ColumnScan::between(view.nameCodes, view.rows, code, code, out.data());
+        }
+    }
+};
+
+// Sizes in KB, both bounds inclusive.
+class SizeFilter : public Filter {
+private:
+    int minSize;
+    int maxSize;
+
+public:
+    SizeFilter(int size) : minSize(size), maxSize(size) {}
+    SizeFilter(int minSize, int maxSize) : minSize(minSize), maxSize(maxSize) {}
+
+    // an empty range (min > max) matches nothing
+    static SizeFilter greaterThan(int size) { return size == INT_MAX ? SizeFilter(1, 0) : SizeFilter(size + 1, INT_MAX); }
+    static SizeFilter lessThan(int size) { return size == INT_MIN ? SizeFilter(1, 0) : SizeFilter(INT_MIN, size - 1); }
+    static SizeFilter between(int minSize, int maxSize) { return SizeFilter(minSize, maxSize); }
+
+    bool matches(const File& file) const override {
+        return file.getSize() >= minSize && file.getSize() <= maxSize;
+    }
+
+    double selectivity(const FileIndex* index) const override {
+        if (index != nullptr && index->size() > 0) {
+            return (double)index->countSizes(minSize, maxSize) / index->size();
+        }
+        return minSize == maxSize ? 0.01 : 0.3;
+    }
+
+    bool lookup(const FileIndex& index, std::vector<uint32_t>& rows) const override {
+        index.sizeRange(minSize, maxSize, rows);
+        return true;
+    }
+
+    void select(const FileCatalogView& view, SelectionBitmap& out) const override {
+        out.reset(view.rows);
+        if (minSize <= maxSize) {
+            ColumnScan::between(view.sizes, view.rows, minSize, maxSize, out.data());
+        }
+    }
+};
+
+enum class PatternKind { Exact, Prefix, Suffix, Substring, Glob, Regex };
+
+// Matches "name.ext" (or just the name when there is no extension) against
+// a pattern compiled once in the constructor: globs are split on '*' into
+// segments placed left to right, substrings go through memmem, and regexes
+// are built once with std::regex::optimize and searched unanchored.
+//
+// The glob dialect is fnmatch's without flags, minus backslash escapes and
+// [:class:], [.coll.] and [=equiv=] inside brackets: '*', '?', and bracket
+// expressions with ranges, '!' or '^' negation and a leading ']'. A '['
+// that is never closed matches itself.
+class NamePatternFilter : public Filter {
+private:
+    // one set of accepted bytes per position; literal holds the text when
+    // every set is a single byte, so the segment can be found with memmem
+    struct GlobSegment {
+        std::vector<std::bitset<256>> accepts;
+        std::string literal;
+        bool plain = true;
+
+        size_t size() const { return accepts.size(); }
+    };
+
+    PatternKind kind;
+    std::string pattern;
+    std::vector<GlobSegment> segments;
+    std::regex regex;
+
+    // parses the bracket expression opening at pattern[open]; returns the
+    // index just past its ']', or npos when it is never closed
+    static size_t parseBracket(const std::string& pattern, size_t open, std::bitset<256>& set) {
+        size_t i = open + 1;
+        bool negate = i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^');
+        if (negate) {
+            ++i;
+        }
+        set.reset();
+        for (bool first = true; i < pattern.size(); first = false) {
+            unsigned char low = pattern[i];
+            if (low == ']' && !first) {
+                if (negate) {
+                    set.flip();
+                }
+                return i + 1;
+            }
+            if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+                unsigned char high = pattern[i + 2];
+                for (unsigned c = low; c <= high; ++c) {
+                    set.set(c);
+                }
+                i += 3;
+            } else {
+                set.set(low);
+                ++i;
+            }
+        }
+        return std::string::npos;
+    }
+
+    static bool segmentAt(std::string_view text, size_t pos, const GlobSegment& segment) {
+        if (pos + segment.size() > text.size()) {
+            return false;
+        }
+        if (segment.plain) {
+            return text.compare(pos, segment.size(), segment.literal) == 0;
+        }
+        for (size_t i = 0; i < segment.size(); ++i) {
+            if (!segment.accepts[i].test((unsigned char)text[pos + i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static size_t findSegment(std::string_view text, size_t from, const GlobSegment& segment) {
+        if (segment.plain) {
+            const void* hit = ::memmem(text.data() + from, text.size() - from, segment.literal.data(), segment.size());
+            return hit == nullptr ? std::string_view::npos : (const char*)hit - text.data();
+        }
+        for (size_t pos = from; pos + segment.size() <= text.size(); ++pos) {
+            if (segmentAt(text, pos, segment)) {
+                return pos;
+            }
+        }
+        return std::string_view::npos;
+    }
+
+    // the first and last segments are anchored; the ones between stars are
+    // placed leftmost, which is enough since every segment has a fixed length
+    bool matchGlob(std::string_view text) const {
+        const GlobSegment& first = segments.front();
+        const GlobSegment& last = segments.back();
+        if (segments.size() == 1) {
+            return text.size() == first.size() && segmentAt(text, 0, first);
+        }
+        if (text.size() < first.size() + last.size() || !segmentAt(text, 0, first) ||
+            !segmentAt(text, text.size() - last.size(), last)) {
+            return false;
+        }
+        std::string_view middle = text.substr(0, text.size() - last.size());
+        size_t pos = first.size();
+        for (size_t i = 1; i + 1 < segments.size(); ++i) {
+            size_t hit = findSegment(middle, pos, segments[i]);
+            if (hit == std::string_view::npos) {
+                return false;
+            }
+            pos = hit + segments[i].size();
+        }
+        return true;
+    }
+
+    void compileGlob() {
+        segments.emplace_back();
+        for (size_t i = 0; i < pattern.size();) {
+            GlobSegment& segment = segments.back();
+            std::bitset<256> set;
+            char c = pattern[i];
+            if (c == '*') {
+                segments.emplace_back();
+                ++i;
+                continue;
+            }
+            size_t end = c == '[' ? parseBracket(pattern, i, set) : std::string::npos;
+            if (end != std::string::npos) {
+                segment.plain = false;
+                i = end;
+            } else if (c == '?') {
+                set.set();
+                segment.plain = false;
+                ++i;
+            } else {
+                set.reset();
+                set.set((unsigned char)c);
+                segment.literal += c;
+                ++i;
+            }
+            segment.accepts.push_back(set);
+        }
+    }
+
+    bool test(std::string_view name, std::string_view extension) const {
+        static thread_local std::string full;
+        full.assign(name.data(), name.size());
+        if (!extension.empty()) {
+            full += '.';
+            full.append(extension.data(), extension.size());
+        }
+        std::string_view text(full);
+        switch (kind) {
+            case PatternKind::Exact: return text == pattern;
+            case PatternKind::Prefix: return text.substr(0, pattern.size()) == pattern;
+            case PatternKind::Suffix:
+                return text.size() >= pattern.size() && text.substr(text.size() - pattern.size()) == pattern;
+            case PatternKind::Substring:
+                return ::memmem(text.data(), text.size(), pattern.data(), pattern.size()) != nullptr;
+            case PatternKind::Glob: return matchGlob(text);
+            case PatternKind::Regex: return std::regex_search(text.begin(), text.end(), regex);
+        }
+        return false;
+    }
+
+public:
+    NamePatternFilter(PatternKind kind, const std::string& pattern) : kind(kind), pattern(pattern) {
+        if (kind == PatternKind::Glob) {
+            compileGlob();
+        } else if (kind == PatternKind::Regex) {
+            regex = std::regex(pattern, std::regex::ECMAScript | std::regex::optimize);
+        }
+    }
+
+    bool matches(const File& file) const override {
+        return test(file.getName(), file.getExtension());
+    }
+
+    // an exact pattern is either a whole extensionless name or a
+    // name.ext split at its last dot, both of which the index can count
+    double selectivity(const FileIndex* index) const override {
+        if (kind != PatternKind::Exact) {
+            return 0.1;
+        }
+        if (index == nullptr || index->size() == 0) {
+            return 0.001;
+        }
+        size_t count = index->withName(pattern).size();
+        size_t dot = pattern.rfind('.');
+        if (dot != std::string::npos) {
+            count += std::min(index->withName(pattern.substr(0, dot)).size(),
+                              index->withExtension(pattern.substr(dot + 1)).size());
+        }
+        return std::min(1.0, (double)count / index->size());
+    }
+
+    // The pattern runs once per distinct (name code, extension code) pair,
+    // memoized in two bitmaps over the pair space; the rows themselves are
+    // a scan of the code columns. If the pair space is too sparse for
+    // that to pay, every row is tested instead.
+    void select(const FileCatalogView& view, SelectionBitmap& out) const override {
+        out.reset(view.rows);
+        size_t extensions = view.extensions.count;
+        size_t pairs = view.names.count * extensions;
+        if (extensions == 0 || pairs / extensions != view.names.count || pairs > 64 * view.rows + 4096) {
+            for (size_t row = 0; row < view.rows; ++row) {
+                if (test(view.names.at(view.nameCodes[row]), view.extensions.at(view.extensionCodes[row]))) {
+                    out.set(row);
+                }
+            }
+            return;
+        }
+        SelectionBitmap known(pairs);
+        SelectionBitmap hit(pairs);
+        for (size_t row = 0; row < view.rows; ++row) {
+            size_t pair = (size_t)view.nameCodes[row] * extensions + (size_t)view.extensionCodes[row];
+            if (!known.test(pair)) {
+                known.set(pair);
+                if (test(view.names.at(view.nameCodes[row]), view.extensions.at(view.extensionCodes[row]))) {
+                    hit.set(pair);
+                }
+            }
+            if (hit.test(pair)) {
+                out.set(row);
+            }
+        }
+    }
 };
 
-class SizeFilter : public Filter {
+class AndFilter : public Filter {
 private:
-    int size;
+    Filter* filter1;
+    Filter* filter2;
 
 public:
-    SizeFilter(int size) : size(size) {}
+    AndFilter(Filter* filter1, Filter* filter2) : filter1(filter1), filter2(filter2) {}
 
-    std::vector<File> meetCriteria(const std::vector<File>& files) const override {
-        std::vector<File> filteredFiles;
-        for (const auto& file : files) {
-            if (file.getSize() == size) {
-                filteredFiles.push_back(file);
+    bool matches(const File& file) const override {
+        return filter1->matches(file) && filter2->matches(file);
+    }
+
+    double selectivity(const FileIndex* index) const override {
+        return filter1->selectivity(index) * filter2->selectivity(index);
+    }
+
+    void conjuncts(std::vector<const Filter*>& out) const override {
+        filter1->conjuncts(out);
+        filter2->conjuncts(out);
+    }
+
+    // the second filter only sees what the first one kept
+    void refine(const std::vector<File>& files, std::vector<uint32_t>& rows) const override {
+        filter1->refine(files, rows);
+        if (!rows.empty()) {
+            filter2->refine(files, rows);
+        }
+    }
+
+    void select(const FileCatalogView& view, SelectionBitmap& out) const override {
+        SelectionBitmap second;
+        filter1->select(view, out);
+        filter2->select(view, second);
+        out &= second;
+    }
+};
+
+class OrFilter : public Filter {
+private:
+    Filter* filter1;
+    Filter* filter2;
+
+public:
+    OrFilter(Filter* filter1, Filter* filter2) : filter1(filter1), filter2(filter2) {}
+
+    bool matches(const File& file) const override {
+        return filter1->matches(file) || filter2->matches(file);
+    }
+
+    double selectivity(const FileIndex* index) const override {
+        double a = filter1->selectivity(index), b = filter2->selectivity(index);
+        return a + b - a * b;
+    }
+
+    void select(const FileCatalogView& view, SelectionBitmap& out) const override {
+        SelectionBitmap second;
+        filter1->select(view, out);
+        filter2->select(view, second);
+        out |= second;
+    }
+};
+
+class NotFilter : public Filter {
+private:
+    Filter* filter;
+
+public:
+    NotFilter(Filter* filter) : filter(filter) {}
+
+    bool matches(const File& file) const override {
+        return !filter->matches(file);
+    }
+
+    double selectivity(const FileIndex* index) const override {
+        return 1.0 - filter->selectivity(index);
+    }
+
+    void select(const FileCatalogView& view, SelectionBitmap& out) const override {
+        filter->select(view, out);
+        out.flip();
+    }
+};
+
+// Flattens a query into its conjuncts and runs the most selective first,
+// so every later filter only sees the rows that survived. With an index
+// the first conjunct is answered by a lookup instead of a scan, unless it
+// would return so much of the list that scanning is cheaper.
+class QueryPlanner {
+private:
+    static constexpr double indexCutoff = 0.2;
+
+public:
+    static std::vector<const Filter*> plan(const Filter& filter, const FileIndex* index) {
+        std::vector<const Filter*> steps;
+        filter.conjuncts(steps);
+        std::vector<double> estimates;
+        for (const Filter* step : steps) {
+            estimates.push_back(step->selectivity(index));
+        }
+        std::vector<size_t> order(steps.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return estimates[a] < estimates[b]; });
+        std::vector<const Filter*> ordered;
+        for (size_t i : order) {
+            ordered.push_back(steps[i]);
+        }
+        return ordered;
+    }
+
+    static void execute(const std::vector<File>& files, const Filter& filter, const FileIndex* index,
+                        std::vector<uint32_t>& rows) {
+        std::vector<const Filter*> steps = plan(filter, index);
+        size_t next = 0;
+        if (index != nullptr && index->size() == files.size() && !steps.empty() &&
+            steps[0]->selectivity(index) < indexCutoff && steps[0]->lookup(*index, rows)) {
+            next = 1;
+        } else {
+            rows.resize(files.size());
+            for (size_t i = 0; i < rows.size(); ++i) {
+                rows[i] = (uint32_t)i;
+            }
+        }
+        for (; next < steps.size() && !rows.empty(); ++next) {
+            steps[next]->refine(files, rows);
+        }
+    }
+};
+
+// A query over a file list that runs when first asked for its rows. The
+// result is a list of indexes into the original vector; files are only
+// copied by materialize().
+class FilterResult {
+private:
+    const std::vector<File>* files;
+    const Filter* filter;
+    const FileIndex* index;
+    mutable bool evaluated;
+    mutable std::vector<uint32_t> selection;
+
+    void evaluate() const {
+        if (!evaluated) {
+            QueryPlanner::execute(*files, *filter, index, selection);
+            evaluated = true;
+        }
+    }
+
+public:
+    // the index, if given, must have been built over files
+    FilterResult(const std::vector<File>& files, const Filter& filter, const FileIndex* index = nullptr)
+        : files(&files), filter(&filter), index(index), evaluated(false) {}
+
+    const std::vector<uint32_t>& rows() const {
+        evaluate();
+        return selection;
+    }
+
+    size_t count() const { return rows().size(); }
+
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        for (uint32_t row : rows()) {
+            fn((*files)[row]);
+        }
+    }
+
+    std::vector<File> materialize() const {
+        std::vector<File> result;
+        result.reserve(count());
+        forEach([&](const File& file) { result.push_back(file); });
+        return result;
+    }
+};
+
+enum class FileChange { Added, Modified, Removed };
+
+struct FileUpdate {
+    FileChange change;
+    std::string directory;
+    File file;
+};
+
+// Walks directory trees on the pool, one task per directory, reading
+// entries in 64KB getdents64 batches and stat-ing regular files relative to
+// the open directory. Files that pass the filter are streamed to the sink
+// as Added updates, a batch per directory. Every directory found is
+// watched with inotify, and poll() turns later changes into updates
+// instead of rescanning. Sink calls are serialized; Removed updates are
+// sent unfiltered since the size of a deleted file is unknown. While live,
+// the crawler remembers which files it reported in each directory, so a
+// directory that is deleted or moved away yields a Removed update for every
+// file reported under it and its watches are dropped; a directory moved in
+// is crawled like a new one.
+class FileCrawler {
+private:
+    struct DirEntry64 {
+        uint64_t inode;
+        int64_t offset;
+        unsigned short length;
+        unsigned char type;
+        char name[];
+    };
+
+    WorkStealingPool& pool;
+    const Filter* filter;
+    std::function<void(const FileUpdate&)> sink;
+    std::mutex sinkLock;
+    int notifyFd;
+    std::mutex watchLock;
+    std::unordered_map<int, std::string> watches;
+    std::map<std::string, std::set<std::string>> reported;  // directory -> "name.ext" sent as Added
+    std::atomic<size_t> outstanding;
+    std::atomic<size_t> scanned;
+
+    // "name.ext" splits on the last dot; sizes round up to whole KB
+    static File makeFile(std::string_view entry, long long bytes) {
+        size_t dot = entry.rfind('.');
+        std::string name(dot == std::string_view::npos || dot == 0 ? entry : entry.substr(0, dot));
+        std::string extension(dot == std::string_view::npos || dot == 0 ? std::string_view() : entry.substr(dot + 1));
+        return File(name, extension, (int)std::min((bytes + 1023) / 1024, (long long)INT_MAX));
+    }
+
+    bool passes(const File& file) const {
+        return filter == nullptr || filter->matches(file);
+    }
+
+    static std::string entryName(const File& file) {
+        return file.getExtension().empty() ? file.getName() : file.getName() + "." + file.getExtension();
+    }
+
+    void remember(const FileUpdate& update) {
+        if (notifyFd < 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(watchLock);
+        if (update.change == FileChange::Removed) {
+            auto it = reported.find(update.directory);
+            if (it != reported.end()) {
+                it->second.erase(entryName(update.file));
+            }
+        } else {
+            reported[update.directory].insert(entryName(update.file));
+        }
+    }
+
+    // stops watching dir and everything under it and queues a Removed
+    // update for every file reported there
+    void forgetTree(const std::string& dir, std::vector<FileUpdate>& batch) {
+        std::string prefix = dir + "/";
+        std::lock_guard<std::mutex> guard(watchLock);
+        for (auto it = watches.begin(); it != watches.end();) {
+            if (it->second == dir || it->second.compare(0, prefix.size(), prefix) == 0) {
+                ::inotify_rm_watch(notifyFd, it->first);
+                it = watches.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // keys starting with dir are contiguous; siblings like "dir-x" sort
+        // among them and are stepped over
+        for (auto it = reported.lower_bound(dir); it != reported.end() && it->first.compare(0, dir.size(), dir) == 0;) {
+            if (it->first.size() != dir.size() && it->first[dir.size()] != '/') {
+                ++it;
+                continue;
+            }
+            for (const std::string& entry : it->second) {
+                batch.push_back(FileUpdate{FileChange::Removed, it->first, makeFile(entry, 0)});
+            }
+            it = reported.erase(it);
+        }
+    }
+
+    void send(std::vector<FileUpdate>& batch) {
+        if (batch.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(sinkLock);
+        for (const FileUpdate& update : batch) {
+            sink(update);
+        }
+        batch.clear();
+    }
+
+    void watch(const std::string& dir) {
+        if (notifyFd < 0) {
+            return;
+        }
+        int wd = ::inotify_add_watch(notifyFd, dir.c_str(),
+                                     IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd < 0) {
+            std::perror(dir.c_str());
+            return;
+        }
+        std::lock_guard<std::mutex> guard(watchLock);
+        watches[wd] = dir;
+    }
+
+    void spawn(std::string dir) {
+        outstanding.fetch_add(1);
+        pool.submit([this, dir]() { scanDirectory(dir); });
+    }
+
+    void scanDirectory(const std::string& dir) {
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            std::perror(dir.c_str());
+            outstanding.fetch_sub(1);
+            return;
+        }
+        watch(dir);
+        std::vector<FileUpdate> batch;
+        alignas(8) char buffer[1 << 16];
+        size_t files = 0;
+        for (;;) {
+            long n = ::syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                if (n < 0) {
+                    std::perror(dir.c_str());
+                }
+                break;
+            }
+            for (long pos = 0; pos < n;) {
+                const DirEntry64* entry = (const DirEntry64*)(buffer + pos);
+                pos += entry->length;
+                std::string_view name(entry->name);
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                unsigned char type = entry->type;
+                struct stat st;
+                bool statted = false;
+                if (type == DT_UNKNOWN) {
+                    if (::fstatat(fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                        continue;
+                    }
+                    statted = true;
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+                std::string child = dir == "/" ? "/" + std::string(name) : dir + "/" + std::string(name);
+                if (type == DT_DIR) {
+                    spawn(child);
+                } else if (type == DT_REG) {
+                    if (!statted && ::fstatat(fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                        continue;
+                    }
+                    ++files;
+                    File file = makeFile(name, st.st_size);
+                    if (passes(file)) {
+                        batch.push_back(FileUpdate{FileChange::Added, dir, file});
+                        remember(batch.back());
+                    }
+                }
+            }
+        }
+        ::close(fd);
+        scanned.fetch_add(files);
+        send(batch);
+        outstanding.fetch_sub(1);
+    }
+
+    // helps the pool until every spawned directory is done
+    void waitForScans() {
+        while (outstanding.load() > 0) {
+            if (!pool.runPending()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+public:
+    // filter may be null to pass every file; live = false skips inotify
+    FileCrawler(WorkStealingPool& pool, const Filter* filter, std::function<void(const FileUpdate&)> sink, bool live = true)
+        : pool(pool), filter(filter), sink(std::move(sink)), notifyFd(-1), outstanding(0), scanned(0) {
+        if (live) {
+            notifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (notifyFd < 0) {
+                std::perror("inotify_init1");
+            }
+        }
+    }
+
+    ~FileCrawler() {
+        waitForScans();
+        if (notifyFd >= 0) {
+            ::close(notifyFd);
+        }
+    }
+
+    FileCrawler(const FileCrawler&) = delete;
+    FileCrawler& operator=(const FileCrawler&) = delete;
+
+    // returns how many regular files were seen, matching or not
+    size_t crawl(const std::string& root) {
+        size_t before = scanned.load();
+        spawn(root);
+        waitForScans();
+        return scanned.load() - before;
+    }
+
+    // Waits up to timeoutMs for changes under crawled directories and sends
+    // them to the sink. New directories are crawled and watched. Returns the
+    // number of inotify events handled.
+    size_t poll(int timeoutMs) {
+        if (notifyFd < 0) {
+            return 0;
+        }
+        struct pollfd pfd{notifyFd, POLLIN, 0};
+        if (::poll(&pfd, 1, timeoutMs) <= 0) {
+            return 0;
+        }
+        alignas(struct inotify_event) char buffer[1 << 16];
+        size_t handled = 0;
+        std::vector<FileUpdate> batch;
+        // crawled once the events read so far are handled, so a new watch
+        // never races with the removal of an old one for the same inode
+        std::vector<std::string> newDirectories;
+        for (;;) {
+            ssize_t n = ::read(notifyFd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                break;
+            }
+            for (ssize_t pos = 0; pos < n;) {
+                const struct inotify_event* event = (const struct inotify_event*)(buffer + pos);
+                pos += sizeof(struct inotify_event) + event->len;
+                ++handled;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    std::cerr << "inotify queue overflowed, some changes were lost\n";
+                    continue;
+                }
+                std::string dir;
+                {
+                    std::lock_guard<std::mutex> guard(watchLock);
+                    auto it = watches.find(event->wd);
+                    if (it == watches.end()) {
+                        continue;
+                    }
+                    if (event->mask & IN_IGNORED) {
+                        watches.erase(it);
+                        continue;
+                    }
+                    dir = it->second;
+                }
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    // only still watched if its parent isn't, e.g. a crawl root
+                    forgetTree(dir, batch);
+                    continue;
+                }
+                if (event->len == 0) {
+                    continue;
+                }
+                std::string_view name(event->name);
+                std::string path = dir + "/" + std::string(name);
+                if (event->mask & IN_ISDIR) {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        newDirectories.push_back(path);
+                    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        forgetTree(path, batch);
+                    }
+                    continue;
+                }
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    batch.push_back(FileUpdate{FileChange::Removed, dir, makeFile(name, 0)});
+                    remember(batch.back());
+                    continue;
+                }
+                struct stat st;
+                if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                    continue;
+                }
+                File file = makeFile(name, st.st_size);
+                if (passes(file)) {
+                    FileChange change = event->mask & (IN_CREATE | IN_MOVED_TO) ? FileChange::Added : FileChange::Modified;
+                    batch.push_back(FileUpdate{change, dir, file});
+                    remember(batch.back());
+                }
+            }
+        }
+        send(batch);
+        for (std::string& dir : newDirectories) {
+            spawn(std::move(dir));
+        }
+        waitForScans();
+        return handled;
+    }
+};
+
+struct QueryStats {
+    size_t rows;
+    size_t matched;
+    size_t chunks;
+    double seconds;     // wall time of the query, or of the whole batch
+    double cpuSeconds;  // time spent in this query's chunks, summed over threads
+};
+
+// Runs filters on the pool in fixed-size chunks. Each chunk is refined with
+// the planned conjunct order into its own row list, and the lists are then
+// copied into place by prefix sum, so results come back in input order.
+// Batches run every (query, chunk) pair as one parallel loop so small
+// queries do not leave threads idle.
+class ParallelFilterExecutor {
+private:
+    WorkStealingPool& pool;
+    size_t chunkRows;
+
+    using Clock = std::chrono::steady_clock;
+
+    static double since(Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    static void evaluateChunk(const std::vector<File>& files, const std::vector<const Filter*>& steps,
+                              size_t begin, size_t end, std::vector<uint32_t>& rows) {
+        rows.resize(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            rows[i - begin] = (uint32_t)i;
+        }
+        for (size_t s = 0; s < steps.size() && !rows.empty(); ++s) {
+            steps[s]->refine(files, rows);
+        }
+    }
+
+    void merge(const std::vector<std::vector<uint32_t>>& parts, std::vector<uint32_t>& out) {
+        std::vector<size_t> offsets(parts.size() + 1, 0);
+        for (size_t i = 0; i < parts.size(); ++i) {
+            offsets[i + 1] = offsets[i] + parts[i].size();
+        }
+        out.resize(offsets.back());
+        pool.parallelFor(0, parts.size(), 1, [&](size_t lo, size_t hi) {
+            for (size_t i = lo; i < hi; ++i) {
+                std::copy(parts[i].begin(), parts[i].end(), out.begin() + offsets[i]);
+            }
+        });
+    }
+
+public:
+    // chunkRows is rounded to a multiple of 64 so catalog chunks own whole
+    // bitmap words
+    explicit ParallelFilterExecutor(WorkStealingPool& pool, size_t chunkRows = 16384)
+        : pool(pool), chunkRows(std::max((size_t)64, chunkRows / 64 * 64)) {}
+
+    std::vector<uint32_t> run(const std::vector<File>& files, const Filter& filter, QueryStats* stats = nullptr) {
+        return std::move(runBatch(files, {&filter}, stats)[0]);
+    }
+
+    // stats, if given, receives one entry per query
+    std::vector<std::vector<uint32_t>> runBatch(const std::vector<File>& files, const std::vector<const Filter*>& queries,
+                                                QueryStats* stats = nullptr) {
+        Clock::time_point start = Clock::now();
+        size_t chunks = (files.size() + chunkRows - 1) / chunkRows;
+        std::vector<std::vector<const Filter*>> plans;
+        for (const Filter* query : queries) {
+            plans.push_back(QueryPlanner::plan(*query, nullptr));
+        }
+        std::vector<std::vector<uint32_t>> parts(queries.size() * chunks);
+        std::unique_ptr<std::atomic<uint64_t>[]> nanos(new std::atomic<uint64_t>[queries.size()]);
+        for (size_t q = 0; q < queries.size(); ++q) {
+            nanos[q].store(0);
+        }
+        pool.parallelFor(0, parts.size(), 1, [&](size_t lo, size_t hi) {
+            for (size_t task = lo; task < hi; ++task) {
+                size_t q = task / chunks, chunk = task % chunks;
+                Clock::time_point chunkStart = Clock::now();
+                evaluateChunk(files, plans[q], chunk * chunkRows, std::min(files.size(), (chunk + 1) * chunkRows), parts[task]);
+                nanos[q].fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - chunkStart).count());
+            }
+        });
+        std::vector<std::vector<uint32_t>> results(queries.size());
+        for (size_t q = 0; q < queries.size(); ++q) {
+            std::vector<std::vector<uint32_t>> queryParts(std::make_move_iterator(parts.begin() + q * chunks),
+                                                          std::make_move_iterator(parts.begin() + (q + 1) * chunks));
+            merge(queryParts, results[q]);
+        }
+        double seconds = since(start);
+        for (size_t q = 0; stats != nullptr && q < queries.size(); ++q) {
+            stats[q] = QueryStats{files.size(), results[q].size(), chunks, seconds, nanos[q].load() / 1e9};
+        }
+        return results;
+    }
+
+    // the catalog form: chunks scan column slices into their own words of out
+    void select(const FileCatalogView& view, const Filter& filter, SelectionBitmap& out, QueryStats* stats = nullptr) {
+        Clock::time_point start = Clock::now();
+        out.reset(view.rows);
+        size_t chunks = (view.rows + chunkRows - 1) / chunkRows;
+        std::atomic<uint64_t> nanos(0);
+        pool.parallelFor(0, chunks, 1, [&](size_t lo, size_t hi) {
+            SelectionBitmap part;
+            for (size_t chunk = lo; chunk < hi; ++chunk) {
+                Clock::time_point chunkStart = Clock::now();
+                size_t first = chunk * chunkRows;
+                FileCatalogView slice = view;
+                slice.rows = std::min(view.rows - first, chunkRows);
+                slice.sizes += first;
+                slice.nameCodes += first;
+                slice.extensionCodes += first;
+                filter.select(slice, part);
+                std::copy(part.data(), part.data() + (slice.rows + 63) / 64, out.data() + first / 64);
+                nanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - chunkStart).count());
+            }
+        });
+        if (stats != nullptr) {
+            *stats = QueryStats{view.rows, out.count(), chunks, since(start), nanos.load() / 1e9};
+        }
+    }
+};
+
+// Randomized checks of NamePatternFilter: globs of literals, '?', '*' and
+// bracket expressions against fnmatch, and the memoized column select against matches().
+class PatternChecks {
+private:
+    static uint64_t next(uint64_t& state) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    static std::string randomText(uint64_t& state, const char* alphabet, size_t maxLength) {
+        std::string text(next(state) % (maxLength + 1), ' ');
+        for (char& c : text) {
+            c = alphabet[next(state) % std::strlen(alphabet)];
+        }
+        return text;
+    }
+
+public:
+    static bool globAgainstFnmatch(uint64_t seed, int cases) {
+        uint64_t state = seed | 1;
+        for (int i = 0; i < cases; ++i) {
+            std::string pattern = randomText(state, "ab.??**[[]!^-", 7);
+            // collating symbols are outside the supported dialect, and glibc
+            // rejects an unclosed '[' cut off halfway through a range
+            size_t open = pattern.find('[');
+            if (open != std::string::npos &&
+                (pattern.find("[.", open + 1) != std::string::npos || pattern.back() == '-')) {
+                continue;
+            }
+            File file(randomText(state, "ab.[]-!", 5), randomText(state, "ab", 2), 1);
+            std::string full = file.getName();
+            if (!file.getExtension().empty()) {
+                full += "." + file.getExtension();
+            }
+            NamePatternFilter filter(PatternKind::Glob, pattern);
+            if (filter.matches(file) != (::fnmatch(pattern.c_str(), full.c_str(), 0) == 0)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // few distinct names and extensions exercise the per-pair memo, many
+    // of both the per-row fallback
+    static bool selectAgainstMatches(uint64_t seed, size_t rows, size_t distinctNames, size_t distinctExtensions) {
+        uint64_t state = seed | 1;
+        const char* common[] = {"txt", "log", "tar.gz", ""};
+        std::vector<File> files;
+        for (size_t i = 0; i < rows; ++i) {
+            size_t extension = next(state) % distinctExtensions;
+            files.emplace_back("f" + std::to_string(next(state) % distinctNames),
+                               extension < 4 ? common[extension] : "e" + std::to_string(extension), 1);
+        }
+        FileCatalog catalog(files);
+        std::pair<PatternKind, const char*> patterns[] = {
+            {PatternKind::Exact, "f1.txt"}, {PatternKind::Prefix, "f1"}, {PatternKind::Suffix, "1.log"},
+            {PatternKind::Substring, "2.t"}, {PatternKind::Glob, "f*3.t?r*"}, {PatternKind::Regex, "^f[0-4]+\\.log$"}};
+        for (const auto& [kind, pattern] : patterns) {
+            NamePatternFilter filter(kind, pattern);
+            SelectionBitmap selected;
+            filter.select(catalog.view(), selected);
+            for (size_t row = 0; row < rows; ++row) {
+                if (selected.test(row) != filter.matches(files[row])) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+int main() {
+    std::vector<File> files = {
+        File("file1", "txt", 100),
+        File("file2", "pdf", 200),
+        File("file3", "txt", 150),
+        File("file4", "doc", 250),
+        File("file5", "txt", 100)
+    };
+
+    // Create individual filters
+    Filter* txtFilter = new ExtensionFilter("txt");
+    Filter* sizeFilter = new SizeFilter(100);
+    Filter* nameFilter = new NameFilter("file3");
+
+    // Combine filters
+    Filter* andFilter = new AndFilter(txtFilter, sizeFilter);
+
+    // Apply filters
+    std::vector<File> txtFiles = txtFilter->meetCriteria(files);
+    std::vector<File> txtAndSizeFiles = andFilter->meetCriteria(files);
+
+    // (txt and 100KB) or not pdf, evaluated without copying a File
+    Filter* pdfFilter = new ExtensionFilter("pdf");
+    Filter* notPdf = new NotFilter(pdfFilter);
+    Filter* query = new OrFilter(andFilter, notPdf);
+    FilterResult result(files, *query);
+    result.forEach([](const File& file) { std::cout << file.getName() << "." << file.getExtension() << " "; });
+    std::cout << "\n";
+
+    // txt files over 120KB, planned against an index
+    FileIndex index(files);
+    Filter* bigFilter = new SizeFilter(SizeFilter::greaterThan(120));
+    Filter* bigTxt = new AndFilter(txtFilter, bigFilter);
+    FilterResult indexed(files, *bigTxt, &index);
+    std::cout << "big txt files: " << indexed.count() << "\n";
+
+    Filter* globFilter = new NamePatternFilter(PatternKind::Glob, "file*.t?t");
+    Filter* regexFilter = new NamePatternFilter(PatternKind::Regex, "^file[45]\\.");
+    std::cout << "file*.t?t: " << FilterResult(files, *globFilter).count()
+              << ", ^file[45]\\.: " << FilterResult(files, *regexFilter).count() << "\n";
+
+    // crawl the working directory once for source files; it is not
+    // watched, a large checkout could use up the inotify watch limit
+    WorkStealingPool pool;
+    Filter* sourceFilter = new OrFilter(new ExtensionFilter("cpp"), new ExtensionFilter("txt"));
+    size_t found = 0;
+    auto report = [&](const FileUpdate& update) {
+        const char* kind = update.change == FileChange::Added ? "added" : update.change == FileChange::Modified ? "modified" : "removed";
+        if (++found <= 5 || update.change != FileChange::Added) {
+            std::cout << kind << " " << update.directory << "/" << update.file.getName() << "." << update.file.getExtension()
+                      << " " << update.file.getSize() << "KB\n";
+        }
+    };
+    FileCrawler once(pool, sourceFilter, report, false);
+    size_t seen = once.crawl(".");
+    std::cout << found << " of " << seen << " files match\n";
+    FileCrawler crawler(pool, sourceFilter, report);
+    // follow a scratch directory: a file comes and goes, then a directory
+    // holding a file is moved out of the crawled tree
+    char scratch[] = "/tmp/crawler_demoXXXXXX";
+    if (::mkdtemp(scratch) != nullptr) {
+        std::string dir = scratch;
+        std::string moved = dir + ".moved";
+        crawler.crawl(dir);
+        std::ofstream(dir + "/notes.txt") << "hello\n";
+        crawler.poll(100);
+        ::unlink((dir + "/notes.txt").c_str());
+        crawler.poll(100);
+        ::mkdir((dir + "/sub").c_str(), 0755);
+        crawler.poll(100);
+        std::ofstream(dir + "/sub/todo.txt") << "hello\n";
+        crawler.poll(100);
+        ::rename((dir + "/sub").c_str(), moved.c_str());
+        crawler.poll(100);
+        ::unlink((moved + "/todo.txt").c_str());
+        ::rmdir(moved.c_str());
+        ::rmdir(dir.c_str());
+        crawler.poll(100);
+    }
+
+    // a batch of queries over the same list, spread over every core
+    ParallelFilterExecutor executor(pool);
+    std::vector<const Filter*> batch = {txtFilter, andFilter, query, bigTxt};
+    std::vector<QueryStats> stats(batch.size());
+    std::vector<std::vector<uint32_t>> batchRows = executor.runBatch(files, batch, stats.data());
+    for (size_t q = 0; q < batch.size(); ++q) {
+        std::cout << "query " << q << ": " << stats[q].matched << " of " << stats[q].rows << " in "
+                  << stats[q].cpuSeconds * 1e6 << "us\n";
+    }
+
+    // the same query as a column scan
+    FileCatalog catalog(files);
+    SelectionBitmap selected;
+    andFilter->select(catalog.view(), selected);
+    std::vector<File> scanned = catalog.materialize(selected);
+    std::cout << "txt and 100KB: " << scanned.size() << " of " << catalog.size() << "\n";
+
+    // saved once, then opened and queried in place on the next start
+    if (catalog.save("files.catalog")) {
+        MappedFileCatalog mapped("files.catalog");
+        SelectionBitmap fromDisk;
+        andFilter->select(mapped.view(), fromDisk);
+        std::cout << "mapped catalog: " << fromDisk.count() << " of " << mapped.size()
+                  << (mapped.verify() ? ", verified" : ", corrupt") << "\n";
+    }
+
+    bool patternsOk = PatternChecks::globAgainstFnmatch(1, 100000) &&
+                      PatternChecks::selectAgainstMatches(1, 20000, 50, 4) &&
+                      PatternChecks::selectAgainstMatches(2, 5000, 1000, 1000);
+    std::cout << "pattern check: " << (patternsOk ? "ok" : "FAILED") << "\n";
+
+    return 0;
+}
+
+
+// pick a sorting algorithm during runtime
+
+////////////////////////////////
+// Strategy   /////////////////
+///////////////////////////////
+
+// Building blocks shared by the sort strategies and the templated sorts.
+struct SortKernels {
+    static constexpr size_t insertionThreshold = 24;
+    static constexpr size_t networkSize = 16;
+
+    template<typename T, typename Compare>
+    static void insertionSort(T* begin, T* end, Compare comp) {
+        for(T* cur = begin + 1; cur < end; ++cur) {
+            T tmp = std::move(*cur);
+            T* sift = cur;
+            for(; sift != begin && comp(tmp, sift[-1]); --sift) {
+                *sift = std::move(sift[-1]);
+            }
+            *sift = std::move(tmp);
+        }
+    }
+
+    // the element before begin must not be greater than anything in range
+    template<typename T, typename Compare>
+    static void unguardedInsertionSort(T* begin, T* end, Compare comp) {
+        for(T* cur = begin + 1; cur < end; ++cur) {
+            T tmp = std::move(*cur);
+            T* sift = cur;
+            for(; comp(tmp, sift[-1]); --sift) {
+                *sift = std::move(sift[-1]);
+            }
+            *sift = std::move(tmp);
+        }
+    }
+
+    // gives up, returning false, once it has moved more than 8 elements
+    template<typename T, typename Compare>
+    static bool partialInsertionSort(T* begin, T* end, Compare comp) {
+        size_t moved = 0;
+        for(T* cur = begin + 1; cur < end; ++cur) {
+            if(comp(*cur, cur[-1])) {
+                T tmp = std::move(*cur);
+                T* sift = cur;
+                do {
+                    *sift = std::move(sift[-1]);
+                    --sift;
+                } while(sift != begin && comp(tmp, sift[-1]));
+                *sift = std::move(tmp);
+                moved += cur - sift;
+                if(moved > 8) {
+                    return false;
+                }
             }
         }
-        return filteredFiles;
+        return true;
     }
-};
 
-class AndFilter : public Filter {
-private:
-    Filter* filter1;
-    Filter* filter2;
+    template<typename T, typename Compare>
+    static void siftDown(T* heap, size_t size, size_t root, Compare comp) {
+        T tmp = std::move(heap[root]);
+        for(size_t child; (child = 2 * root + 1) < size; root = child) {
+            if(child + 1 < size && comp(heap[child], heap[child + 1])) {
+                ++child;
+            }
+            if(!comp(tmp, heap[child])) {
+                break;
+            }
+            heap[root] = std::move(heap[child]);
+        }
+        heap[root] = std::move(tmp);
+    }
 
-public:
-    AndFilter(Filter* filter1, Filter* filter2) : filter1(filter1), filter2(filter2) {}
+    template<typename T, typename Compare>
+    static void heapSort(T* begin, T* end, Compare comp) {
+        size_t size = end - begin;
+        for(size_t i = size / 2; i-- > 0;) {
+            siftDown(begin, size, i, comp);
+        }
+        for(size_t last = size; last-- > 1;) {
+            std::swap(begin[0], begin[last]);
+            siftDown(begin, last, 0, comp);
+        }
+    }
 
-    std::vector<File> meetCriteria(const std::vector<File>& files) const override {
-        std::vector<File> firstCriteriaFiles = filter1->meetCriteria(files);
-        return filter2->meetCriteria(firstCriteriaFiles);
+    template<typename T, typename Compare>
+    static void sort3(T* a, T* b, T* c, Compare comp) {
+        if(comp(*b, *a)) std::swap(*a, *b);
+        if(comp(*c, *b)) std::swap(*b, *c);
+        if(comp(*b, *a)) std::swap(*a, *b);
     }
-};
 
-int main() {
-    std::vector<File> files = {
-        File("file1", "txt", 100),
-        File("file2", "pdf", 200),
-        File("file3", "txt", 150),
-        File("file4", "doc", 250),
-        File("file5", "txt", 100)
+    // Batcher's odd-even merge network for 16 inputs, 63 compare-exchanges
+    struct Network {
+        uint8_t pairs[63][2];
+        size_t count;
+        constexpr Network() : pairs(), count(0) {
+            for(size_t p = 1; p < networkSize; p <<= 1) {
+                for(size_t k = p; k >= 1; k >>= 1) {
+                    for(size_t j = k % p; j + k < networkSize; j += 2 * k) {
+                        for(size_t i = 0; i < k && i + j + k < networkSize; ++i) {
+                            if((i + j) / (2 * p) == (i + j + k) / (2 * p)) {
+                                pairs[count][0] = (uint8_t)(i + j);
+                                pairs[count][1] = (uint8_t)(i + j + k);
+                                ++count;
+                            }
+                        }
+                    }
+                }
+            }
+        }
     };
 
-    // Create individual filters
-    Filter* txtFilter = new ExtensionFilter("txt");
-    Filter* sizeFilter = new SizeFilter(100);
-    Filter* nameFilter = new NameFilter("file3");
+    // Sorts up to 16 ints with a fixed network padded with INT_MAX. Every
+    // compare-exchange is a min and a max, so there are no branches to
+    // mispredict and the compiler can use vector min/max.
+    static void networkSort(int* data, size_t n) {
+        static constexpr Network network{};
+        int v[networkSize];
+        for(size_t i = 0; i < networkSize; ++i) {
+            v[i] = i < n ? data[i] : INT_MAX;
+        }
+        for(size_t c = 0; c < network.count; ++c) {
+            int a = v[network.pairs[c][0]], b = v[network.pairs[c][1]];
+            v[network.pairs[c][0]] = std::min(a, b);
+            v[network.pairs[c][1]] = std::max(a, b);
+        }
+        std::copy(v, v + n, data);
+    }
 
-    // Combine filters
-    Filter* andFilter = new AndFilter(txtFilter, sizeFilter);
+    template<typename T, typename Compare>
+    static constexpr bool usesNetwork = std::is_same<T, int>::value && std::is_same<Compare, std::less<int>>::value;
 
-    // Apply filters
-    std::vector<File> txtFiles = txtFilter->meetCriteria(files);
-    std::vector<File> txtAndSizeFiles = andFilter->meetCriteria(files);
+    template<typename T, typename Compare>
+    static void smallSort(T* begin, T* end, Compare comp, bool leftmost) {
+        if constexpr(usesNetwork<T, Compare>) {
+            if((size_t)(end - begin) <= networkSize) {
+                networkSort(begin, end - begin);
+                return;
+            }
+        }
+        if(leftmost) {
+            insertionSort(begin, end, comp);
+        } else {
+            unguardedInsertionSort(begin, end, comp);
+        }
+    }
 
-    return 0;
-}
+    // Partitions around *begin into < pivot and >= pivot. Returns the pivot's
+    // final place and whether the range was already partitioned.
+    template<typename T, typename Compare>
+    static std::pair<T*, bool> partitionRight(T* begin, T* end, Compare comp) {
+        T pivot = std::move(*begin);
+        T* first = begin;
+        T* last = end;
+        while(comp(*++first, pivot));
+        if(first - 1 == begin) {
+            while(first < last && !comp(*--last, pivot));
+        } else {
+            while(!comp(*--last, pivot));
+        }
+        bool alreadyPartitioned = first >= last;
+        while(first < last) {
+            std::swap(*first, *last);
+            while(comp(*++first, pivot));
+            while(!comp(*--last, pivot));
+        }
+        T* pivotPos = first - 1;
+        *begin = std::move(*pivotPos);
+        *pivotPos = std::move(pivot);
+        return std::make_pair(pivotPos, alreadyPartitioned);
+    }
 
+    // Puts everything equal to the pivot on the left; used when the pivot
+    // equals the element before the range, so that run is finished at once.
+    template<typename T, typename Compare>
+    static T* partitionLeft(T* begin, T* end, Compare comp) {
+        T pivot = std::move(*begin);
+        T* first = begin;
+        T* last = end;
+        while(comp(pivot, *--last));
+        if(last + 1 == end) {
+            while(first < last && !comp(pivot, *++first));
+        } else {
+            while(!comp(pivot, *++first));
+        }
+        while(first < last) {
+            std::swap(*first, *last);
+            while(comp(pivot, *--last));
+            while(!comp(pivot, *++first));
+        }
+        T* pivotPos = last;
+        *begin = std::move(*pivotPos);
+        *pivotPos = std::move(pivot);
+        return pivotPos;
+    }
 
-// pick a sorting algorithm during runtime
+    template<typename T, typename Compare>
+    static void pdqLoop(T* begin, T* end, Compare comp, int badAllowed, bool leftmost) {
+        for(;;) {
+            size_t size = end - begin;
+            if(size < insertionThreshold) {
+                smallSort(begin, end, comp, leftmost);
+                return;
+            }
+            // median of three, or a ninther on large ranges, moved to *begin
+            size_t half = size / 2;
+            if(size > 128) {
+                sort3(begin, begin + half, end - 1, comp);
+                sort3(begin + 1, begin + (half - 1), end - 2, comp);
+                sort3(begin + 2, begin + (half + 1), end - 3, comp);
+                sort3(begin + (half - 1), begin + half, begin + (half + 1), comp);
+                std::swap(*begin, begin[half]);
+            } else {
+                sort3(begin + half, begin, end - 1, comp);
+            }
+            if(!leftmost && !comp(begin[-1], *begin)) {
+                begin = partitionLeft(begin, end, comp) + 1;
+                continue;
+            }
+            std::pair<T*, bool> split = partitionRight(begin, end, comp);
+            T* pivotPos = split.first;
+            size_t left = pivotPos - begin, right = end - (pivotPos + 1);
+            if(left < size / 8 || right < size / 8) {
+                // a bad split: fall back to heapsort if it keeps happening,
+                // otherwise break up whatever pattern caused it
+                if(--badAllowed == 0) {
+                    heapSort(begin, end, comp);
+                    return;
+                }
+                if(left >= insertionThreshold) {
+                    std::swap(begin[0], begin[left / 4]);
+                    std::swap(pivotPos[-1], pivotPos[-(ptrdiff_t)(left / 4)]);
+                }
+                if(right >= insertionThreshold) {
+                    std::swap(pivotPos[1], pivotPos[1 + right / 4]);
+                    std::swap(end[-1], end[-(ptrdiff_t)(right / 4)]);
+                }
+            } else if(split.second && partialInsertionSort(begin, pivotPos, comp) &&
+                      partialInsertionSort(pivotPos + 1, end, comp)) {
+                return;
+            }
+            pdqLoop(begin, pivotPos, comp, badAllowed, leftmost);
+            begin = pivotPos + 1;
+            leftmost = false;
+        }
+    }
 
-////////////////////////////////
-// Strategy   /////////////////
-///////////////////////////////
+    // LSD radix sort on an unsigned key: 8 bits a pass for 32 bit keys and
+    // 11 for 64 bit ones, which needs six passes instead of eight. All
+    // histograms come from one read of the input, and passes where every
+    // key has the same digit are skipped. scratch must hold n elements.
+    template<typename T, typename KeyFn>
+    static void lsdRadixSort(T* data, T* scratch, size_t n, KeyFn key) {
+        using Key = decltype(key(*data));
+        static_assert(std::is_unsigned<Key>::value, "radix keys must be unsigned");
+        constexpr size_t digitBits = sizeof(Key) > 4 ? 11 : 8;
+        constexpr size_t radix = (size_t)1 << digitBits;
+        constexpr size_t passes = (sizeof(Key) * 8 + digitBits - 1) / digitBits;
+        std::vector<size_t> counts(passes * radix, 0);
+        for(size_t i = 0; i < n; ++i) {
+            Key k = key(data[i]);
+            for(size_t p = 0; p < passes; ++p) {
+                counts[p * radix + ((k >> (digitBits * p)) & (radix - 1))]++;
+            }
+        }
+        T* from = data;
+        T* to = scratch;
+        for(size_t p = 0; p < passes; ++p) {
+            size_t* bucket = counts.data() + p * radix;
+            if(n == 0 || bucket[(key(from[0]) >> (digitBits * p)) & (radix - 1)] == n) {
+                continue;
+            }
+            size_t sum = 0;
+            for(size_t b = 0; b < radix; ++b) {
+                size_t c = bucket[b];
+                bucket[b] = sum;
+                sum += c;
+            }
+            for(size_t i = 0; i < n; ++i) {
+                to[bucket[(key(from[i]) >> (digitBits * p)) & (radix - 1)]++] = std::move(from[i]);
+            }
+            std::swap(from, to);
+        }
+        if(from != data) {
+            std::move(from, from + n, data);
+        }
+    }
+
+    // signed ints as unsigned keys in the same order
+    static uint32_t intKey(int v) {
+        return (uint32_t)v ^ 0x80000000u;
+    }
+};
+
+// Pattern-defeating quicksort: introsort that detects already sorted and
+// equal runs and shuffles away adversarial patterns.
+template<typename T, typename Compare = std::less<T>>
+void pdqSort(T* begin, T* end, Compare comp = Compare()) {
+    size_t size = end - begin;
+    if(size < 2) {
+        return;
+    }
+    int log2 = 0;
+    while(size >>= 1) {
+        ++log2;
+    }
+    SortKernels::pdqLoop(begin, end, comp, log2, true);
+}
 
 class SortStrategy {
     public:
+        virtual ~SortStrategy() {}
         virtual void sort(std::vector<int>& data) = 0;
 };
 
 class BubbleSort: public SortStrategy {
     public:
+        // stops after a pass with no swaps
         void sort(std::vector<int>&data) override {
-            std::cout<<"do bubble sort";
+            for(size_t end = data.size(); end > 1; --end) {
+                bool swapped = false;
+                for(size_t i = 1; i < end; ++i) {
+                    if(data[i] < data[i - 1]) {
+                        std::swap(data[i], data[i - 1]);
+                        swapped = true;
+                    }
+                }
+                if(!swapped) {
+                    break;
+                }
+            }
         }
 };
 
 class QuickSort: public SortStrategy {
+    private:
+        // Hoare partition around a median of three; recurses on the smaller
+        // side so the stack stays logarithmic
+        static void quickSort(int* begin, int* end) {
+            while(end - begin > 16) {
+                int* mid = begin + (end - begin) / 2;
+                SortKernels::sort3(begin, mid, end - 1, std::less<int>());
+                int pivot = *mid;
+                int* i = begin - 1;
+                int* j = end;
+                for(;;) {
+                    while(*++i < pivot);
+                    while(pivot < *--j);
+                    if(i >= j) {
+                        break;
+                    }
+                    std::swap(*i, *j);
+                }
+                if(j + 1 - begin < end - (j + 1)) {
+                    quickSort(begin, j + 1);
+                    begin = j + 1;
+                } else {
+                    quickSort(j + 1, end);
+                    end = j + 1;
+                }
+            }
+            SortKernels::insertionSort(begin, end, std::less<int>());
+        }
     public:
         void sort(std::vector<int>&data) override {
-            std::cout<<"do quick sort";
+            quickSort(data.data(), data.data() + data.size());
         }
 };
 
 class MergeSort: public SortStrategy {
     public:
+        // bottom-up: sorted runs of 32, then merge passes alternating
+        // between data and one scratch buffer; ordered neighbours are copied
+        void sort(std::vector<int>&data) override {
+            size_t n = data.size();
+            const size_t run = 32;
+            for(size_t i = 0; i < n; i += run) {
+                SortKernels::insertionSort(data.data() + i, data.data() + std::min(n, i + run), std::less<int>());
+            }
+            std::vector<int> scratch(n);
+            int* from = data.data();
+            int* to = scratch.data();
+            for(size_t width = run; width < n; width *= 2) {
+                for(size_t lo = 0; lo < n; lo += 2 * width) {
+                    size_t mid = std::min(n, lo + width), hi = std::min(n, lo + 2 * width);
+                    if(mid == hi || from[mid - 1] <= from[mid]) {
+                        std::copy(from + lo, from + hi, to + lo);
+                    } else {
+                        std::merge(from + lo, from + mid, from + mid, from + hi, to + lo);
+                    }
+                }
+                std::swap(from, to);
+            }
+            if(from != data.data()) {
+                std::copy(from, from + n, data.data());
+            }
+        }
+};
+
+class IntroSort: public SortStrategy {
+    private:
+        static void introLoop(int* begin, int* end, int depth, bool leftmost) {
+            while((size_t)(end - begin) >= SortKernels::insertionThreshold) {
+                if(depth-- == 0) {
+                    SortKernels::heapSort(begin, end, std::less<int>());
+                    return;
+                }
+                int* mid = begin + (end - begin) / 2;
+                SortKernels::sort3(mid, begin, end - 1, std::less<int>());
+                int* pivot = SortKernels::partitionRight(begin, end, std::less<int>()).first;
+                introLoop(begin, pivot, depth, leftmost);
+                begin = pivot + 1;
+                leftmost = false;
+            }
+            SortKernels::smallSort(begin, end, std::less<int>(), leftmost);
+        }
+    public:
+        // quicksort until the recursion is 2 log n deep, then heapsort
+        void sort(std::vector<int>&data) override {
+            int depth = 0;
+            for(size_t n = data.size(); n > 1; n >>= 1) {
+                depth += 2;
+            }
+            introLoop(data.data(), data.data() + data.size(), depth, true);
+        }
+};
+
+class RadixSort: public SortStrategy {
+    public:
+        void sort(std::vector<int>&data) override {
+            std::vector<int> scratch(data.size());
+            SortKernels::lsdRadixSort(data.data(), scratch.data(), data.size(), SortKernels::intKey);
+        }
+};
+
+class PdqSort: public SortStrategy {
+    public:
+        void sort(std::vector<int>&data) override {
+            pdqSort(data.data(), data.data() + data.size());
+        }
+};
+
+// Looks at the whole input once (descents, minimum, maximum) and picks:
+// nothing for sorted input, a reverse for strictly descending input,
+// counting sort when the values span no more than the input length, merge
+// sort for nearly sorted input (its merges of ordered neighbours are
+// copies), pdqsort for small input and radix sort for the rest.
+class AdaptiveSort: public SortStrategy {
+    private:
+        static constexpr size_t radixMinimum = 1 << 12;
+
+        static void countingSort(std::vector<int>& data, int lo, size_t range) {
+            std::vector<uint32_t> counts(range, 0);
+            for(int v : data) {
+                counts[(size_t)((int64_t)v - lo)]++;
+            }
+            size_t out = 0;
+            for(size_t i = 0; i < range; ++i) {
+                std::fill_n(data.begin() + out, counts[i], (int)(lo + (int64_t)i));
+                out += counts[i];
+            }
+        }
+    public:
+        void sort(std::vector<int>&data) override {
+            size_t n = data.size();
+            if(n <= SortKernels::networkSize) {
+                SortKernels::networkSort(data.data(), n);
+                return;
+            }
+            size_t descents = 0;
+            int lo = data[0], hi = data[0];
+            for(size_t i = 1; i < n; ++i) {
+                descents += data[i] < data[i - 1];
+                lo = std::min(lo, data[i]);
+                hi = std::max(hi, data[i]);
+            }
+            if(descents == 0) {
+                return;
+            }
+            if(descents == n - 1) {
+                std::reverse(data.begin(), data.end());
+                return;
+            }
+            uint64_t range = (uint64_t)((int64_t)hi - lo) + 1;
+            if(range <= n) {
+                countingSort(data, lo, range);
+            } else if(descents < n / 16) {
+                MergeSort().sort(data);
+            } else if(n < radixMinimum) {
+                pdqSort(data.data(), data.data() + n);
+            } else {
+                RadixSort().sort(data);
+            }
+        }
+};
+
+// Parallel sorts run on a shared WorkStealingPool. grain is the number of
+// elements one task handles. Scratch space comes from the caller's buffer
+// when one is given, otherwise from a buffer the strategy keeps between
+// calls, so repeated sorts do not allocate. One strategy object must not be
+// used from two threads at once.
+class ParallelSortStrategy: public SortStrategy {
+    protected:
+        WorkStealingPool& pool;
+        size_t grain;
+        std::vector<int>* scratch;
+        std::vector<int> ownScratch;
+
+        int* scratchFor(size_t n) {
+            std::vector<int>& buffer = scratch != nullptr ? *scratch : ownScratch;
+            if(buffer.size() < n) {
+                buffer.resize(n);
+            }
+            return buffer.data();
+        }
+    public:
+        ParallelSortStrategy(WorkStealingPool& pool, size_t grain, std::vector<int>* scratch)
+            : pool(pool), grain(std::max((size_t)1024, grain)), scratch(scratch) {}
+
+        void setGrain(size_t elements) {
+            grain = std::max((size_t)1024, elements);
+        }
+};
+
+// Sorts grain-sized blocks in parallel, then merges pairs of runs pass by
+// pass. Every merge is cut into grain-sized pieces of output whose inputs
+// are found by binary search (co-ranking), so the last passes, with only
+// a few long runs left, still use every thread.
+class ParallelMergeSort: public ParallelSortStrategy {
+    private:
+        struct MergeTask {
+            size_t lo, mid, hi;  // runs [lo, mid) and [mid, hi)
+            size_t first, last;  // output positions within [lo, hi)
+        };
+        std::vector<MergeTask> tasks;
+
+        // how many of the first k merged elements come from a, ties
+        // taken from a first
+        static size_t coRank(size_t k, const int* a, size_t m, const int* b, size_t n) {
+            size_t lo = k > n ? k - n : 0, hi = std::min(k, m);
+            while(lo < hi) {
+                size_t i = (lo + hi + 1) / 2;
+                if(a[i - 1] <= b[k - i]) {
+                    lo = i;
+                } else {
+                    hi = i - 1;
+                }
+            }
+            return lo;
+        }
+    public:
+        explicit ParallelMergeSort(WorkStealingPool& pool, size_t grain = 1 << 16, std::vector<int>* scratch = nullptr)
+            : ParallelSortStrategy(pool, grain, scratch) {}
+
+        void sort(std::vector<int>&data) override {
+            size_t n = data.size();
+            if(n <= grain) {
+                pdqSort(data.data(), data.data() + n);
+                return;
+            }
+            int* from = data.data();
+            int* to = scratchFor(n);
+            pool.parallelFor(0, n, grain, [&](size_t lo, size_t hi) {
+                pdqSort(from + lo, from + hi);
+            });
+            for(size_t width = grain; width < n; width *= 2) {
+                tasks.clear();
+                for(size_t lo = 0; lo < n; lo += 2 * width) {
+                    size_t mid = std::min(n, lo + width), hi = std::min(n, lo + 2 * width);
+                    for(size_t first = lo; first < hi; first += grain) {
+                        tasks.push_back(MergeTask{lo, mid, hi, first, std::min(hi, first + grain)});
+                    }
+                }
+                pool.parallelFor(0, tasks.size(), 1, [&](size_t lo, size_t hi) {
+                    for(size_t t = lo; t < hi; ++t) {
+                        const MergeTask& task = tasks[t];
+                        const int* a = from + task.lo;
+                        const int* b = from + task.mid;
+                        size_t m = task.mid - task.lo, len = task.hi - task.mid;
+                        size_t i0 = coRank(task.first - task.lo, a, m, b, len);
+                        size_t i1 = coRank(task.last - task.lo, a, m, b, len);
+                        size_t j0 = task.first - task.lo - i0, j1 = task.last - task.lo - i1;
+                        std::merge(a + i0, a + i1, b + j0, b + j1, to + task.first);
+                    }
+                });
+                std::swap(from, to);
+            }
+            if(from != data.data()) {
+                pool.parallelFor(0, n, grain, [&](size_t lo, size_t hi) {
+                    std::copy(from + lo, from + hi, data.data() + lo);
+                });
+            }
+        }
+};
+
+// Picks bucket splitters from an oversampled, sorted sample, counts bucket
+// sizes per block in parallel, scatters every block into its slots of the
+// scratch buffer, then sorts the buckets in parallel and copies them back.
+// A key common enough to be picked as several neighbouring splitters would
+// fill one bucket and leave a single thread sorting most of the input, so
+// in that case every splitter also gets an equality bucket holding just
+// the keys equal to it, which needs no sorting at all.
+class ParallelSampleSort: public ParallelSortStrategy {
+    private:
+        static constexpr size_t maxBuckets = 256;
+        static constexpr size_t oversampling = 32;
+        std::vector<int> splitters;
+        std::vector<size_t> counts;  // block * buckets + bucket
+        std::vector<size_t> bucketStart;
+
+        // number of splitters <= v; buckets is a power of two, so this is a
+        // fixed number of branch-free steps
+        size_t bucketOf(int v, size_t buckets) const {
+            size_t pos = 0;
+            for(size_t step = buckets / 2; step > 0; step /= 2) {
+                pos += splitters[pos + step - 1] <= v ? step : 0;
+            }
+            return pos;
+        }
+
+        // with equality buckets, class 2b holds the keys equal to splitter
+        // b - 1 and class 2b + 1 the keys strictly between splitters b - 1 and b
+        size_t classOf(int v, size_t buckets, bool equality) const {
+            size_t b = bucketOf(v, buckets);
+            if(!equality) {
+                return b;
+            }
+            return 2 * b + (b == 0 || splitters[b - 1] != v);
+        }
+    public:
+        explicit ParallelSampleSort(WorkStealingPool& pool, size_t grain = 1 << 16, std::vector<int>* scratch = nullptr)
+            : ParallelSortStrategy(pool, grain, scratch) {}
+
         void sort(std::vector<int>&data) override {
-            std::cout<<"do merge sort";
+            size_t n = data.size();
+            if(n <= 2 * grain) {
+                pdqSort(data.data(), data.data() + n);
+                return;
+            }
+            size_t buckets = 2;
+            while(buckets * 2 <= std::min(maxBuckets, n / grain)) {
+                buckets *= 2;
+            }
+            size_t blocks = (n + grain - 1) / grain;
+
+            // splitters from an evenly spread pseudo-random sample
+            splitters.resize(buckets * oversampling);
+            uint64_t state = 0x9E3779B97F4A7C15ull ^ n;
+            for(int& sample : splitters) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                sample = data[state % n];
+            }
+            pdqSort(splitters.data(), splitters.data() + splitters.size());
+            bool equality = false;
+            for(size_t b = 1; b < buckets; ++b) {
+                splitters[b - 1] = splitters[b * oversampling];
+                equality = equality || (b > 1 && splitters[b - 2] == splitters[b - 1]);
+            }
+            size_t classes = equality ? 2 * buckets : buckets;
+
+            counts.assign(blocks * classes, 0);
+            pool.parallelFor(0, blocks, 1, [&](size_t lo, size_t hi) {
+                for(size_t block = lo; block < hi; ++block) {
+                    size_t* count = counts.data() + block * classes;
+                    for(size_t i = block * grain, end = std::min(n, i + grain); i < end; ++i) {
+                        count[classOf(data[i], buckets, equality)]++;
+                    }
+                }
+            });
+            // bucket-major prefix sum: each block gets its own slot range in
+            // every bucket
+            bucketStart.assign(classes + 1, 0);
+            size_t sum = 0;
+            for(size_t c = 0; c < classes; ++c) {
+                bucketStart[c] = sum;
+                for(size_t block = 0; block < blocks; ++block) {
+                    size_t count = counts[block * classes + c];
+                    counts[block * classes + c] = sum;
+                    sum += count;
+                }
+            }
+            bucketStart[classes] = n;
+
+            int* out = scratchFor(n);
+            pool.parallelFor(0, blocks, 1, [&](size_t lo, size_t hi) {
+                for(size_t block = lo; block < hi; ++block) {
+                    size_t* slot = counts.data() + block * classes;
+                    for(size_t i = block * grain, end = std::min(n, i + grain); i < end; ++i) {
+                        out[slot[classOf(data[i], buckets, equality)]++] = data[i];
+                    }
+                }
+            });
+            pool.parallelFor(0, classes, 1, [&](size_t lo, size_t hi) {
+                for(size_t c = lo; c < hi; ++c) {
+                    if(!equality || c % 2 == 1) {
+                        pdqSort(out + bucketStart[c], out + bucketStart[c + 1]);
+                    }
+                    std::copy(out + bucketStart[c], out + bucketStart[c + 1], data.data() + bucketStart[c]);
+                }
+            });
+        }
+};
+
+// Merges k sorted sources by replaying one root-to-leaf path per element:
+// each inner node keeps the loser of its match, the overall winner sits at
+// tree[0], and exhausted sources lose to everything.
+class LoserTree {
+    private:
+        size_t k;
+        std::vector<size_t> tree;
+        std::vector<int> keys;
+        std::vector<char> exhausted;
+
+        bool beats(size_t a, size_t b) const {
+            if(exhausted[a] || exhausted[b]) {
+                return !exhausted[a] && exhausted[b];
+            }
+            return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+        }
+    public:
+        explicit LoserTree(size_t sources) : k(std::max((size_t)1, sources)), tree(k, 0), keys(k, 0), exhausted(k, 1) {}
+
+        // every source's first key (or exhaustion) must be set before build
+        void set(size_t source, int key) {
+            keys[source] = key;
+            exhausted[source] = 0;
+        }
+        void finish(size_t source) {
+            exhausted[source] = 1;
+        }
+
+        void build() {
+            std::vector<size_t> winners(2 * k);
+            for(size_t i = 0; i < k; ++i) {
+                winners[k + i] = i;
+            }
+            for(size_t node = k - 1; node >= 1; --node) {
+                size_t l = winners[2 * node], r = winners[2 * node + 1];
+                winners[node] = beats(l, r) ? l : r;
+                tree[node] = beats(l, r) ? r : l;
+            }
+            tree[0] = k > 1 ? winners[1] : 0;
+        }
+
+        bool empty() const { return exhausted[tree[0]]; }
+        size_t winner() const { return tree[0]; }
+        int top() const { return keys[tree[0]]; }
+
+        // call after the winner's key was changed by set or finish
+        void replay() {
+            size_t winner = tree[0];
+            for(size_t node = (winner + k) / 2; node >= 1; node /= 2) {
+                if(beats(tree[node], winner)) {
+                    std::swap(tree[node], winner);
+                }
+            }
+            tree[0] = winner;
+        }
+};
+
+// Sorts a file of native ints larger than memory. The input is read in
+// runs that fit the budget, each run is sorted with the given strategy and
+// spilled to an unlinked temp file, and the runs are merged through a
+// loser tree, in several passes if there are too many to merge at once.
+// Each run reader has two blocks, and one I/O thread per merge fills the
+// back blocks while the merge consumes the front ones.
+class ExternalSort {
+    private:
+        struct Run {
+            int fd;
+            size_t count;
+        };
+
+        static constexpr size_t readError = SIZE_MAX;
+        static constexpr size_t inFlight = SIZE_MAX - 1;
+
+        // The merge's I/O thread. Reads run in the order they were submitted
+        // and each one stores its outcome, the element count or readError,
+        // through its result pointer.
+        class Prefetcher {
+            private:
+                struct Request {
+                    int fd;
+                    int* data;
+                    size_t count;
+                    size_t offset;
+                    size_t* result;
+                };
+
+                std::mutex lock;
+                std::condition_variable wakeWorker, wakeReaders;
+                std::deque<Request> requests;
+                bool running;
+                std::thread worker;
+
+                void run() {
+                    std::unique_lock<std::mutex> guard(lock);
+                    for(;;) {
+                        wakeWorker.wait(guard, [this]{ return !requests.empty() || !running; });
+                        if(requests.empty()) {
+                            return;
+                        }
+                        Request request = requests.front();
+                        requests.pop_front();
+                        guard.unlock();
+                        bool ok = readAt(request.fd, request.data, request.count, request.offset);
+                        guard.lock();
+                        *request.result = ok ? request.count : readError;
+                        wakeReaders.notify_all();
+                    }
+                }
+            public:
+                Prefetcher(): running(true), worker(&Prefetcher::run, this) {}
+
+                // pending reads are finished before the thread exits
+                ~Prefetcher() {
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        running = false;
+                    }
+                    wakeWorker.notify_one();
+                    worker.join();
+                }
+
+                void submit(int fd, int* data, size_t count, size_t offset, size_t& result) {
+                    {
+                        std::lock_guard<std::mutex> guard(lock);
+                        result = inFlight;
+                        requests.push_back(Request{fd, data, count, offset, &result});
+                    }
+                    wakeWorker.notify_one();
+                }
+
+                size_t wait(const size_t& result) {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wakeReaders.wait(guard, [&result]{ return result != inFlight; });
+                    return result;
+                }
+        };
+
+        class RunReader {
+            private:
+                int fd;
+                size_t next;  // next element to request from the file
+                size_t count;
+                std::vector<int> front, back;
+                size_t pos, frontSize;
+                bool failed;
+                Prefetcher& io;
+                size_t ready;  // elements read into back, inFlight until io is done
+
+                void prefetch() {
+                    size_t want = std::min(back.size(), count - next);
+                    size_t at = next;
+                    next += want;
+                    io.submit(fd, back.data(), want, at * sizeof(int), ready);
+                }
+            public:
+                RunReader(const Run& run, size_t blockElements, Prefetcher& io)
+                    : fd(run.fd), next(0), count(run.count), front(blockElements), back(blockElements), pos(0), frontSize(0),
+                      failed(false), io(io), ready(0) {
+                    prefetch();
+                }
+
+                ~RunReader() {
+                    io.wait(ready);
+                }
+
+                bool hasFailed() const {
+                    return failed;
+                }
+
+                // false once the run is used up or a read failed
+                bool pop(int& value) {
+                    if(pos == frontSize) {
+                        frontSize = io.wait(ready);
+                        if(frontSize == readError) {
+                            failed = true;
+                            frontSize = 0;
+                        }
+                        if(frontSize == 0) {
+                            pos = 0;
+                            ready = 0;
+                            return false;
+                        }
+                        std::swap(front, back);
+                        pos = 0;
+                        ready = 0;
+                        if(next < count) {
+                            prefetch();
+                        }
+                    }
+                    value = front[pos++];
+                    return true;
+                }
+        };
+
+        SortStrategy& strategy;
+        size_t budget;
+        std::string tempDir;
+
+        static bool readAt(int fd, int* data, size_t count, size_t offset) {
+            char* p = (char*)data;
+            size_t left = count * sizeof(int);
+            while(left > 0) {
+                ssize_t n = ::pread(fd, p, left, offset);
+                if(n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(n <= 0) {
+                    return false;
+                }
+                p += n;
+                offset += n;
+                left -= n;
+            }
+            return true;
+        }
+
+        static bool writeAll(int fd, const int* data, size_t count) {
+            const char* p = (const char*)data;
+            size_t left = count * sizeof(int);
+            while(left > 0) {
+                ssize_t n = ::write(fd, p, left);
+                if(n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(n <= 0) {
+                    return false;
+                }
+                p += n;
+                left -= n;
+            }
+            return true;
+        }
+
+        // a temp file that disappears when closed, even after a crash
+        int tempFile() {
+            std::string name = tempDir + "/sortrunXXXXXX";
+            int fd = ::mkstemp(&name[0]);
+            if(fd < 0) {
+                std::perror(name.c_str());
+                return -1;
+            }
+            ::unlink(name.c_str());
+            return fd;
+        }
+
+        // reads up to capacity ints; false on a read error or a partial int
+        static bool fill(int fd, std::vector<int>& buffer, size_t capacity, size_t& got) {
+            buffer.resize(capacity);
+            char* p = (char*)buffer.data();
+            size_t bytes = 0, want = capacity * sizeof(int);
+            while(bytes < want) {
+                ssize_t n = ::read(fd, p + bytes, want - bytes);
+                if(n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if(n < 0) {
+                    return false;
+                }
+                if(n == 0) {
+                    break;
+                }
+                bytes += n;
+            }
+            got = bytes / sizeof(int);
+            buffer.resize(got);
+            return bytes % sizeof(int) == 0;
+        }
+
+        bool merge(const std::vector<Run>& runs, int outFd, size_t blockElements) {
+            Prefetcher io;
+            std::vector<std::unique_ptr<RunReader>> readers;
+            LoserTree tree(runs.size());
+            for(size_t i = 0; i < runs.size(); ++i) {
+                readers.emplace_back(new RunReader(runs[i], blockElements, io));
+                int value;
+                if(readers[i]->pop(value)) {
+                    tree.set(i, value);
+                }
+            }
+            tree.build();
+            std::vector<int> out;
+            out.reserve(blockElements);
+            while(!tree.empty()) {
+                size_t source = tree.winner();
+                out.push_back(tree.top());
+                if(out.size() == blockElements) {
+                    if(!writeAll(outFd, out.data(), out.size())) {
+                        return false;
+                    }
+                    out.clear();
+                }
+                int value;
+                if(readers[source]->pop(value)) {
+                    tree.set(source, value);
+                } else {
+                    tree.finish(source);
+                }
+                tree.replay();
+            }
+            for(const auto& reader : readers) {
+                if(reader->hasFailed()) {
+                    return false;
+                }
+            }
+            return writeAll(outFd, out.data(), out.size());
+        }
+
+        static void closeRuns(std::vector<Run>& runs) {
+            for(Run& run : runs) {
+                ::close(run.fd);
+            }
+            runs.clear();
+        }
+
+    public:
+        // the strategy may allocate a scratch copy of a run, so a run gets
+        // half the budget
+        ExternalSort(SortStrategy& strategy, size_t memoryBudget, const std::string& tempDir)
+            : strategy(strategy), budget(std::max(memoryBudget, (size_t)1 << 20)), tempDir(tempDir) {}
+
+        bool sortFile(const std::string& inputPath, const std::string& outputPath) {
+            int in = ::open(inputPath.c_str(), O_RDONLY | O_CLOEXEC);
+            if(in < 0) {
+                std::perror(inputPath.c_str());
+                return false;
+            }
+            std::vector<Run> runs;
+            {
+                std::vector<int> run;
+                size_t runElements = budget / 2 / sizeof(int), got;
+                for(;;) {
+                    if(!fill(in, run, runElements, got)) {
+                        std::cerr << inputPath << ": read failed or size is not a whole number of ints\n";
+                        ::close(in);
+                        closeRuns(runs);
+                        return false;
+                    }
+                    if(got == 0) {
+                        break;
+                    }
+                    strategy.sort(run);
+                    int fd = tempFile();
+                    if(fd < 0 || !writeAll(fd, run.data(), got)) {
+                        if(fd >= 0) {
+                            std::perror("spill run");
+                            ::close(fd);
+                        }
+                        ::close(in);
+                        closeRuns(runs);
+                        return false;
+                    }
+                    runs.push_back(Run{fd, got});
+                }
+            }
+            ::close(in);
+
+            // each reader holds two blocks and the output one more
+            size_t blockBytes = std::max((size_t)64 << 10, std::min((size_t)4 << 20, budget / (2 * runs.size() + 1)));
+            size_t fanIn = std::max((size_t)2, budget / (2 * blockBytes) - 1);
+            size_t blockElements = blockBytes / sizeof(int);
+            while(runs.size() > fanIn) {
+                std::vector<Run> merged;
+                for(size_t first = 0; first < runs.size(); first += fanIn) {
+                    std::vector<Run> group(runs.begin() + first, runs.begin() + std::min(runs.size(), first + fanIn));
+                    size_t count = 0;
+                    for(const Run& run : group) {
+                        count += run.count;
+                    }
+                    int fd = tempFile();
+                    bool ok = fd >= 0 && merge(group, fd, blockElements);
+                    closeRuns(group);
+                    if(!ok) {
+                        if(fd >= 0) {
+                            std::perror("merge runs");
+                            ::close(fd);
+                        }
+                        for(size_t rest = first + fanIn; rest < runs.size(); ++rest) {
+                            ::close(runs[rest].fd);
+                        }
+                        closeRuns(merged);
+                        return false;
+                    }
+                    merged.push_back(Run{fd, count});
+                }
+                runs.swap(merged);
+            }
+
+            std::string temp = outputPath + ".tmp";
+            int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if(out < 0) {
+                std::perror(temp.c_str());
+                closeRuns(runs);
+                return false;
+            }
+            bool ok = merge(runs, out, blockElements) && ::fsync(out) == 0;
+            if(!ok) {
+                std::perror(temp.c_str());
+            }
+            ::close(out);
+            closeRuns(runs);
+            if(ok && ::rename(temp.c_str(), outputPath.c_str()) != 0) {
+                std::perror(outputPath.c_str());
+                ok = false;
+            }
+            if(!ok) {
+                ::unlink(temp.c_str());
+            }
+            return ok;
         }
 };
 
@@ -511,6 +6866,316 @@ class Sorter {
         void sort(std::vector<int>&data) {
             sortstartegy->sort(data);
         }
+
+        // Sorts a file of native-endian ints that may not fit in memory,
+        // using the strategy for each in-memory run. The output replaces
+        // outputPath only once it is complete. Runs spill to tempDir.
+        bool sortFile(const std::string& inputPath, const std::string& outputPath, size_t memoryBudget,
+                      const std::string& tempDir = P_tmpdir) {
+            return ExternalSort(*sortstartegy, memoryBudget, tempDir).sortFile(inputPath, outputPath);
+        }
+};
+
+struct AutoSortTag {};
+struct PdqSortTag {};
+struct RadixSortTag {};
+
+// Maps an integer or floating point key to an unsigned integer with the
+// same order, for radix sorting. Floats flip every bit when negative and
+// only the sign bit otherwise; -0.0 is folded into 0.0 so the two stay
+// equal as they are under <, and NaNs with the sign clear sort last.
+template<typename K>
+struct RadixKey {
+    using Bits = typename std::conditional<sizeof(K) <= 4, uint32_t, uint64_t>::type;
+    static constexpr Bits signBit = (Bits)1 << (sizeof(Bits) * 8 - 1);
+
+    static Bits encode(K k) {
+        if constexpr(std::is_floating_point<K>::value) {
+            static_assert(sizeof(K) == sizeof(Bits), "float and double keys only");
+            if(k == 0) {
+                k = 0;
+            }
+            Bits b;
+            std::memcpy(&b, &k, sizeof(b));
+            return (b & signBit) ? ~b : b | signBit;
+        } else if constexpr(std::is_signed<K>::value) {
+            return (Bits)(typename std::make_signed<Bits>::type)k ^ signBit;
+        } else {
+            return (Bits)k;
+        }
+    }
+};
+
+// Sorts records by key(record) with the algorithm picked at compile time,
+// so there is no virtual call and the key compare inlines. (Sorter above is
+// the runtime strategy facade, hence the different name.)
+//
+// AutoSortTag radix sorts integer and floating point keys ordered by less
+// or greater, and uses pdqsort otherwise. Records up to 16 bytes are
+// sorted in place. Larger records are sorted as (key, index) pairs and
+// then moved once, in sorted order, into a new buffer, so a large struct
+// is never copied per compare or per pass.
+template<typename T, typename KeyExtractor, typename Compare = std::less<>, typename Algorithm = AutoSortTag>
+class RecordSorter {
+    private:
+        using Key = typename std::decay<decltype(std::declval<const KeyExtractor&>()(std::declval<const T&>()))>::type;
+
+        static constexpr bool ascending = std::is_same<Compare, std::less<>>::value || std::is_same<Compare, std::less<Key>>::value;
+        static constexpr bool descending = std::is_same<Compare, std::greater<>>::value || std::is_same<Compare, std::greater<Key>>::value;
+        static constexpr bool radixable = (ascending || descending) && !std::is_same<Key, bool>::value &&
+                                          (std::is_integral<Key>::value || std::is_same<Key, float>::value || std::is_same<Key, double>::value);
+        static constexpr bool useRadix = std::is_same<Algorithm, RadixSortTag>::value ||
+                                         (std::is_same<Algorithm, AutoSortTag>::value && radixable);
+        static_assert(!std::is_same<Algorithm, RadixSortTag>::value || radixable,
+                      "radix sort needs an integer or floating point key ordered by less or greater");
+        static constexpr size_t directLimit = 16;
+
+        using Bits = typename RadixKey<typename std::conditional<radixable, Key, uint32_t>::type>::Bits;
+
+        // packed so a 64 bit key and its index move as 12 bytes, not 16
+        struct RadixEntry {
+            Bits bits;
+            uint32_t index;
+        } __attribute__((packed));
+
+        struct KeyEntry {
+            Key key;
+            uint32_t index;
+        };
+
+        KeyExtractor key;
+        Compare comp;
+
+        Bits radixBits(const T& record) const {
+            Bits b = RadixKey<Key>::encode(key(record));
+            return descending ? (Bits)~b : b;
+        }
+
+    public:
+        explicit RecordSorter(KeyExtractor key = KeyExtractor(), Compare comp = Compare()) : key(key), comp(comp) {}
+
+        // Fills order so that records[order[i]] is the i-th record in sorted
+        // order; equal keys keep their input order. Up to 2^32 records.
+        void sortIndices(const std::vector<T>& records, std::vector<uint32_t>& order) const {
+            size_t n = records.size();
+            order.resize(n);
+            if constexpr(useRadix) {
+                // left uninitialized, every slot is written before it is read
+                std::unique_ptr<RadixEntry[]> entries(new RadixEntry[n]), scratch(new RadixEntry[n]);
+                for(size_t i = 0; i < n; ++i) {
+                    entries[i] = RadixEntry{radixBits(records[i]), (uint32_t)i};
+                }
+                SortKernels::lsdRadixSort(entries.get(), scratch.get(), n, [](const RadixEntry& e) { return e.bits; });
+                for(size_t i = 0; i < n; ++i) {
+                    order[i] = entries[i].index;
+                }
+            } else {
+                std::vector<KeyEntry> entries;
+                entries.reserve(n);
+                for(size_t i = 0; i < n; ++i) {
+                    entries.push_back(KeyEntry{key(records[i]), (uint32_t)i});
+                }
+                pdqSort(entries.data(), entries.data() + n, [this](const KeyEntry& a, const KeyEntry& b) {
+                    return comp(a.key, b.key) || (!comp(b.key, a.key) && a.index < b.index);
+                });
+                for(size_t i = 0; i < n; ++i) {
+                    order[i] = entries[i].index;
+                }
+            }
+        }
+
+        // stable except for small records sorted in place by pdqsort
+        void sort(std::vector<T>& records) const {
+            if constexpr(sizeof(T) <= directLimit) {
+                if constexpr(useRadix) {
+                    std::vector<T> scratch(records);
+                    SortKernels::lsdRadixSort(records.data(), scratch.data(), records.size(),
+                                              [this](const T& r) { return radixBits(r); });
+                } else {
+                    pdqSort(records.data(), records.data() + records.size(),
+                            [this](const T& a, const T& b) { return comp(key(a), key(b)); });
+                }
+            } else {
+                std::vector<uint32_t> order;
+                sortIndices(records, order);
+                records = gather(records, order);
+            }
+        }
+
+        // records[order[i]] for every i: reads jump around but writes are
+        // sequential, which beats permuting in place
+        static std::vector<T> gather(std::vector<T>& records, const std::vector<uint32_t>& order) {
+            const size_t lookahead = 16;
+            std::vector<T> sorted;
+            sorted.reserve(order.size());
+            for(size_t i = 0; i < order.size(); ++i) {
+                if(i + lookahead < order.size()) {
+                    __builtin_prefetch(&records[order[i + lookahead]]);
+                }
+                sorted.push_back(std::move(records[order[i]]));
+            }
+            return sorted;
+        }
+};
+
+// Randomized checks of the sorts against std::sort, over inputs picked to
+// hit their special cases: presorted and reversed runs, few distinct keys,
+// a single key, sorted data with scattered outliers, and one key making up
+// half of otherwise random data.
+class SortChecks {
+    private:
+        static constexpr int patterns = 9;
+
+        // wide records go through sortIndices and a gather, narrow ones are
+        // sorted in place
+        template<typename K>
+        struct WideRecord {
+            K key;
+            uint32_t seq;
+            char payload[40];
+        };
+        template<typename K>
+        struct NarrowRecord {
+            K key;
+            uint32_t seq;
+        };
+        template<typename R>
+        struct RecordKey {
+            auto operator()(const R& r) const { return r.key; }
+        };
+
+        static uint64_t next(uint64_t& state) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        }
+
+        static std::vector<int> input(uint64_t& state, size_t n, int pattern) {
+            std::vector<int> data(n);
+            for(size_t i = 0; i < n; ++i) {
+                switch(pattern) {
+                    case 0: data[i] = (int)next(state); break;
+                    case 1: data[i] = (int)i; break;
+                    case 2: data[i] = (int)(n - i); break;
+                    case 3: data[i] = (int)(next(state) % 4); break;
+                    case 4: data[i] = (int)(i < n / 2 ? i : n - i); break;
+                    case 5: data[i] = (int)(i % 100); break;
+                    case 6: data[i] = 7; break;
+                    case 7: data[i] = i % 64 == 0 ? (int)next(state) : (int)i; break;
+                    default: data[i] = next(state) % 2 ? 7 : (int)next(state); break;
+                }
+            }
+            return data;
+        }
+
+        static bool sortsFile(Sorter& sorter, std::vector<int> data, const std::string& unsorted, const std::string& sorted,
+                              const std::string& dir) {
+            std::ofstream(unsorted, std::ios::binary).write((const char*)data.data(), data.size() * sizeof(int));
+            if(!sorter.sortFile(unsorted, sorted, 1 << 20, dir)) {
+                return false;
+            }
+            std::sort(data.begin(), data.end());
+            std::vector<int> fromDisk(data.size());
+            std::ifstream in(sorted, std::ios::binary);
+            in.read((char*)fromDisk.data(), fromDisk.size() * sizeof(int));
+            return in && in.get() == EOF && fromDisk == data;
+        }
+
+    public:
+        // every pattern at sizes around the small-sort and network cutoffs
+        // and up to maxSize
+        static bool strategy(SortStrategy& strategy, uint64_t seed, size_t maxSize) {
+            uint64_t state = seed | 1;
+            for(size_t n : {0, 1, 2, 3, 5, 15, 16, 17, 23, 24, 25, 100, 129, 1000, 5000, 70001, 300000}) {
+                if(n > maxSize) {
+                    break;
+                }
+                for(int pattern = 0; pattern < patterns; ++pattern) {
+                    std::vector<int> data = input(state, n, pattern);
+                    std::vector<int> expected = data;
+                    std::sort(expected.begin(), expected.end());
+                    strategy.sort(data);
+                    if(data != expected) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        // round trips through Sorter::sortFile with the minimum 1MB budget,
+        // so the largest size spills more runs than one merge pass takes
+        static bool externalSort(SortStrategy& strategy, const std::string& dir, uint64_t seed) {
+            uint64_t state = seed | 1;
+            std::string unsorted = dir + "/check_unsorted.bin", sorted = dir + "/check_sorted.bin";
+            Sorter sorter(&strategy);
+            bool ok = true;
+            for(size_t n : {0, 1, 5, 131072, 131073, 1200000}) {
+                for(int pattern : {0, 3, 8}) {
+                    ok = ok && sortsFile(sorter, input(state, n, pattern), unsorted, sorted, dir);
+                }
+            }
+            std::remove(unsorted.c_str());
+            std::remove(sorted.c_str());
+            return ok;
+        }
+
+        // sortIndices must match std::stable_sort exactly, and so must sort()
+        // unless a narrow record is sorted in place by pdqsort, where only
+        // the keys have to line up
+        template<template<typename> class Record, typename K, typename Compare,
+                 typename Algorithm = AutoSortTag, typename KeyFn>
+        static bool recordSorter(uint64_t seed, KeyFn randomKey) {
+            using R = Record<K>;
+            uint64_t state = seed | 1;
+            std::vector<R> records(50000);
+            for(size_t i = 0; i < records.size(); ++i) {
+                records[i].key = randomKey(state);
+                records[i].seq = (uint32_t)i;
+            }
+            std::vector<R> expected = records;
+            std::stable_sort(expected.begin(), expected.end(), [](const R& a, const R& b) { return Compare()(a.key, b.key); });
+
+            RecordSorter<R, RecordKey<R>, Compare, Algorithm> sorter;
+            std::vector<uint32_t> order;
+            sorter.sortIndices(records, order);
+            std::vector<R> sorted = records;
+            sorter.sort(sorted);
+            bool stable = sizeof(R) > 16 || !std::is_same<Algorithm, PdqSortTag>::value;
+            for(size_t i = 0; i < records.size(); ++i) {
+                if(records[order[i]].seq != expected[i].seq || !(sorted[i].key == expected[i].key) ||
+                   (stable && sorted[i].seq != expected[i].seq)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static bool recordSorters(uint64_t seed) {
+            auto int8Key = [](uint64_t& state) { return (int8_t)next(state); };
+            auto fewKeys = [](uint64_t& state) { return (uint16_t)(next(state) % 300); };
+            auto int64Key = [](uint64_t& state) { return (int64_t)next(state); };
+            auto floatKey = [](uint64_t& state) {
+                uint64_t r = next(state) % 7;
+                return r == 0 ? -0.0f : r == 1 ? 0.0f : (float)((int)(next(state) % 2000) - 1000) / 7.0f;
+            };
+            auto doubleKey = [](uint64_t& state) { return (int64_t)next(state) / 3.0; };
+            auto intKey = [](uint64_t& state) { return (int)(next(state) % 100); };
+            auto stringKey = [](uint64_t& state) { return std::to_string(next(state) % 1000); };
+            return recordSorter<WideRecord, int8_t, std::less<>>(seed, int8Key) &&
+                   recordSorter<NarrowRecord, int8_t, std::less<>>(seed + 1, int8Key) &&
+                   recordSorter<WideRecord, uint16_t, std::greater<>>(seed + 2, fewKeys) &&
+                   recordSorter<WideRecord, int64_t, std::less<>>(seed + 3, int64Key) &&
+                   recordSorter<NarrowRecord, int64_t, std::greater<int64_t>>(seed + 4, int64Key) &&
+                   recordSorter<WideRecord, float, std::less<>>(seed + 5, floatKey) &&
+                   recordSorter<NarrowRecord, float, std::greater<>>(seed + 6, floatKey) &&
+                   recordSorter<WideRecord, double, std::less<>>(seed + 7, doubleKey) &&
+                   recordSorter<WideRecord, double, std::less<>, PdqSortTag>(seed + 8, doubleKey) &&
+                   recordSorter<NarrowRecord, int, std::less<>, PdqSortTag>(seed + 9, intKey) &&
+                   recordSorter<WideRecord, std::string, std::less<>>(seed + 10, stringKey) &&
+                   recordSorter<WideRecord, std::string, std::greater<>>(seed + 11, stringKey);
+        }
 };
 
 int main() {
@@ -518,6 +7183,94 @@ int main() {
     SortStrategy* bubble = new BubbleSort();
     Sorter* sorter = new Sorter(bubble);
     sorter->sort(vec);
+
+    // each strategy against std::sort on a million random ints
+    std::vector<int> input(1000000);
+    uint64_t state = 88172645463325252ull;
+    for(int& v : input) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        v = (int)state;
+    }
+    std::vector<int> expected = input;
+    auto start = std::chrono::steady_clock::now();
+    std::sort(expected.begin(), expected.end());
+    WorkStealingPool pool;
+    std::vector<int> scratch(input.size());
+    std::cout << "std::sort " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms\n";
+
+    std::pair<const char*, SortStrategy*> strategies[] = {
+        {"quick", new QuickSort()}, {"merge", new MergeSort()}, {"intro", new IntroSort()},
+        {"radix", new RadixSort()}, {"pdq", new PdqSort()}, {"adaptive", new AdaptiveSort()},
+        {"parallel merge", new ParallelMergeSort(pool)}, {"parallel sample", new ParallelSampleSort(pool, 1 << 15, &scratch)},
+    };
+    for(auto& entry : strategies) {
+        std::vector<int> data = input;
+        Sorter runtime(entry.second);
+        start = std::chrono::steady_clock::now();
+        runtime.sort(data);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << entry.first << " " << ms << "ms" << (data == expected ? "" : " WRONG") << "\n";
+    }
+    bool strategiesOk = SortChecks::strategy(*bubble, 1, 1000);
+    for(int i = 0; i < 6; ++i) {
+        strategiesOk = strategiesOk && SortChecks::strategy(*strategies[i].second, i + 2, 300000);
+    }
+    std::cout << "strategy check: " << (strategiesOk ? "ok" : "FAILED") << "\n";
+    // small grains so the checked sizes go through the parallel paths
+    ParallelMergeSort parallelMerge(pool, 1024);
+    ParallelSampleSort parallelSample(pool, 1024);
+    bool parallelOk = SortChecks::strategy(parallelMerge, 8, 300000) && SortChecks::strategy(parallelSample, 9, 300000);
+    std::cout << "parallel check: " << (parallelOk ? "ok" : "FAILED") << "\n";
+
+    // the same input sorted from disk with a 1MB budget, eight spilled
+    // runs, in a scratch directory that is removed afterwards
+    char scratchDir[] = "/tmp/sort_demoXXXXXX";
+    if(::mkdtemp(scratchDir) != nullptr) {
+        std::string dir = scratchDir;
+        std::string unsorted = dir + "/unsorted.bin", sorted = dir + "/sorted.bin";
+        std::ofstream(unsorted, std::ios::binary).write((const char*)input.data(), input.size() * sizeof(int));
+        Sorter external(new AdaptiveSort());
+        start = std::chrono::steady_clock::now();
+        if(external.sortFile(unsorted, sorted, 1 << 20, dir)) {
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            std::vector<int> fromDisk(input.size());
+            std::ifstream(sorted, std::ios::binary).read((char*)fromDisk.data(), fromDisk.size() * sizeof(int));
+            std::cout << "external " << ms << "ms" << (fromDisk == expected ? "" : " WRONG") << "\n";
+        }
+        std::cout << "external check: " << (SortChecks::externalSort(*strategies[4].second, dir, 10) ? "ok" : "FAILED") << "\n";
+        std::remove(unsorted.c_str());
+        std::remove(sorted.c_str());
+        ::rmdir(dir.c_str());
+    }
+
+    // 128 byte records sorted by a double key: key-only radix plus one
+    // permutation pass, against std::sort moving whole records
+    struct Trade {
+        double price;
+        int64_t id;
+        char payload[112];
+    };
+    struct TradePrice {
+        double operator()(const Trade& t) const { return t.price; }
+    };
+    std::vector<Trade> trades(input.size());
+    for(size_t i = 0; i < trades.size(); ++i) {
+        trades[i].price = input[i] / 1000.0;
+        trades[i].id = (int64_t)i;
+    }
+    std::vector<Trade> byStd = trades;
+    start = std::chrono::steady_clock::now();
+    std::sort(byStd.begin(), byStd.end(), [](const Trade& a, const Trade& b) { return a.price < b.price; });
+    std::cout << "std::sort trades " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << "ms\n";
+    RecordSorter<Trade, TradePrice> tradeSorter;
+    start = std::chrono::steady_clock::now();
+    tradeSorter.sort(trades);
+    double tradeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    bool same = std::equal(trades.begin(), trades.end(), byStd.begin(), [](const Trade& a, const Trade& b) { return a.price == b.price; });
+    std::cout << "RecordSorter trades " << tradeMs << "ms" << (same ? "" : " WRONG") << "\n";
+    std::cout << "RecordSorter check: " << (SortChecks::recordSorters(1) ? "ok" : "FAILED") << "\n";
 }
 
 